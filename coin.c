@@ -27,11 +27,91 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+
+// Compile with: gcc -O4 -o coin coin.c -lpthread  (or just: make)
 
+static int verbose = 1;
+
+/* Output format (-f).  The default text renderer is kept bit-stable
+ * for human readers and the existing regex scrapers; "json" streams
+ * the dynamic decision tree as one record per line and "csv" emits
+ * the static code tables as one row per coin, both through the
+ * buffered writer below so consumers can pipeline on the output.
+ */
+enum{ FMT_TEXT = 0, FMT_JSON, FMT_CSV };
 
-// Compile with: gcc -O4 -o coin coin.c
+static int out_fmt = FMT_TEXT;
 
-static int verbose = 1;
+/* Buffered output writer for the strategy printers.  Pushing every
+ * token ("%2d " at a time) through vprintf dominates the run time of
+ * large verbose solves, so the printers assemble bytes in a user-space
+ * buffer with a direct integer-to-ASCII path and hand them to stdio
+ * in large chunks.  logd() flushes the buffer before printing, so the
+ * two paths may be mixed freely.
+ */
+#define OBUF_SIZE (1 << 16)
+
+static char obuf[OBUF_SIZE];
+static int obuf_n = 0;
+
+static void
+out_flush()
+{
+        if(obuf_n > 0) {
+                fwrite(obuf, 1, obuf_n, stdout);
+                obuf_n = 0;
+        }
+}
+
+static inline void
+out_char(       int c   )
+{
+        if(obuf_n == OBUF_SIZE)
+                out_flush();
+        obuf[obuf_n++] = c;
+}
+
+static void
+out_str(        const char *s   )
+{
+        while(*s)
+                out_char(*s++);
+}
+
+/* print v right-aligned in a field of at least w characters ("%*d")
+ */
+static void
+out_int(        int v,
+                int w   )
+{
+        char tmp[12];
+        int n = 0, neg = v < 0;
+        unsigned u = neg ? -(unsigned)v : (unsigned)v;
+        do {
+                tmp[n++] = '0' + u % 10;
+                u /= 10;
+        } while(u);
+        if(neg)
+                tmp[n++] = '-';
+        while(w-- > n)
+                out_char(' ');
+        while(n)
+                out_char(tmp[--n]);
+}
 
 static inline void
 logd(   const char *fmt,
@@ -39,15 +119,221 @@ logd(   const char *fmt,
 {
         va_list ap;
         if(verbose) {
+                out_flush();
                 va_start(ap, fmt);
                 vprintf(fmt, ap);
+                va_end(ap);
         }
 }
-                
+
 
 
 enum{ C_EQUAL = 0, C_MORE, C_LESS, C_DOUBLE };
 
+
+/* Hot-path statistics (compile with -DCOIN_STATS, enable with -t).
+ * Each solver thread counts into its own struct without locks and
+ * folds it into the global total when it exits; the summary goes to
+ * stderr so it never mixes with strategy output.  The counters tell
+ * allocator pressure (arena traffic, set regrows) apart from
+ * algorithmic blowup (weighings, classified possibilities, sieve
+ * probes) and attribute time to the two phases of a weighing step.
+ * Without COIN_STATS every probe compiles to nothing.
+ */
+#ifdef COIN_STATS
+
+typedef struct{
+        long long weighings;            // calls to weigh()
+        long long classified;           // possibilities pushed through it
+        long long op_calls;             // base-3 complements taken
+        long long free_probes;          // occupancy sieve lookups
+        long long set_grows;            // possibility-set regrows
+        long long arena_allocs;         // arena allocations
+        long long arena_bytes;          // bytes handed out by them
+        long long ns_select;            // time finding selections
+        long long ns_classify;          // time classifying in weigh()
+        long long coin_moves;           // scale loads under -c moves
+} coin_stats;
+
+static __thread coin_stats cst;
+static coin_stats cst_all;
+static pthread_mutex_t cst_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int stats_on = 0;                // -t: print the summary
+
+static long long
+stat_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+stats_flush()                   // fold this thread into the total
+{
+        long long *s = (long long*)&cst, *a = (long long*)&cst_all;
+        size_t j;
+        pthread_mutex_lock(&cst_mtx);
+        for(j = 0; j < sizeof(cst) / sizeof(long long); j++)
+                a[j] += s[j];
+        pthread_mutex_unlock(&cst_mtx);
+        bzero(&cst, sizeof(cst));
+}
+
+static void
+stats_dump()
+{
+        if(!stats_on)
+                return;
+        fprintf(stderr, "\nHot-path statistics:\n"
+                " weighings         %15lld\n"
+                " classified        %15lld\n"
+                " op() calls        %15lld\n"
+                " sieve probes      %15lld\n"
+                " set regrows       %15lld\n"
+                " arena allocs      %15lld\n"
+                " arena bytes       %15lld\n"
+                " selection time    %12.3f s\n"
+                " classify time     %12.3f s\n"
+                " coin moves        %15lld\n",
+                cst_all.weighings, cst_all.classified, cst_all.op_calls,
+                cst_all.free_probes, cst_all.set_grows,
+                cst_all.arena_allocs, cst_all.arena_bytes,
+                cst_all.ns_select * 1e-9, cst_all.ns_classify * 1e-9,
+                cst_all.coin_moves);
+}
+
+#define STAT_ADD(fld, v)        (cst.fld += (v))
+#define STAT_TICK(t)            long long t = stat_ns()
+#define STAT_TOCK(fld, t)       (cst.fld += stat_ns() - (t))
+#define STATS_FLUSH()           stats_flush()
+#define STATS_DUMP()            stats_dump()
+
+#else
+
+#define STAT_ADD(fld, v)
+#define STAT_TICK(t)
+#define STAT_TOCK(fld, t)
+#define STATS_FLUSH()
+#define STATS_DUMP()
+
+#endif
+
+
+/* Bump/arena allocator for possibility sets and coin configurations.
+ * All working memory of the solvers is taken from a chain of large
+ * blocks; single allocations are never freed. weigh_sequential() saves
+ * the arena state on entry and restores it on return, so only the sets
+ * along the current path of the weighing tree stay live, and a full
+ * solve performs O(depth) calls to malloc() instead of O(n * depth)
+ * calls to realloc().
+ * Every solver thread owns its own arena, so allocation needs no locks.
+ */
+
+#define ARENA_BLOCKSIZE (1 << 20)
+
+typedef struct arena_block{
+        struct arena_block *next;
+        size_t size;                    // usable bytes in this block
+        size_t used;                    // bytes handed out so far
+} arena_block;
+
+typedef struct{
+        arena_block *blk;               // block being filled
+        size_t used;                    // fill state of that block
+} arena_state;
+
+static __thread arena_block *arena_head = NULL; // first block of the chain
+static __thread arena_block *arena_cur = NULL;  // block being filled
+
+static __thread long arena_nblocks = 0; // blocks malloc'd by this thread
+static __thread long arena_nbytes = 0;  // bytes in those blocks
+
+static arena_block*
+arena_newblock( size_t size     )
+{
+        arena_block *b = malloc(sizeof(arena_block) + size);
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+        arena_nblocks++;
+        arena_nbytes += size;
+        return b;
+}
+
+static void
+arena_init()
+{
+        arena_head = arena_cur = arena_newblock(ARENA_BLOCKSIZE);
+}
+
+static void*
+arena_alloc(    size_t n        )
+{
+        n = (n + 7) & ~(size_t)7;                       // keep alignment
+        STAT_ADD(arena_allocs, 1);
+        STAT_ADD(arena_bytes, n);
+        while(arena_cur->used + n > arena_cur->size) {
+                if(arena_cur->next == NULL)
+                        arena_cur->next = arena_newblock(
+                                n > ARENA_BLOCKSIZE ? n : ARENA_BLOCKSIZE);
+                arena_cur = arena_cur->next;
+                arena_cur->used = 0;
+        }
+        void *p = (char*)(arena_cur + 1) + arena_cur->used;
+        arena_cur->used += n;
+        return p;
+}
+
+static inline arena_state
+arena_save()
+{
+        arena_state s = { arena_cur, arena_cur->used };
+        return s;
+}
+
+static inline void
+arena_restore(  arena_state s   )
+{
+        arena_cur = s.blk;
+        arena_cur->used = s.used;
+}
+
+/* Bytes currently handed out by this thread's arena.
+ */
+static size_t
+arena_inuse()
+{
+        size_t n = 0;
+        arena_block *b = arena_head;
+        for(; b; b = b->next) {
+                n += b->used;
+                if(b == arena_cur)
+                        break;
+        }
+        return n;
+}
+
+/* Whole-tree reset: drop everything, keep the blocks for reuse.
+ */
+static void
+arena_reset()
+{
+        arena_cur = arena_head;
+        arena_cur->used = 0;
+}
+
+static void
+arena_free()
+{
+        arena_block *b = arena_head, *next;
+        for(; b; b = next) {
+                next = b->next;
+                free(b);
+        }
+        arena_head = arena_cur = NULL;
+}
+
 static inline int
 balance(        int x,
                 int y   )
@@ -98,149 +384,607 @@ balance(        int x,
 typedef struct{
         int all_equal;
         int size[4];
+        int n_eq;               // materialized entries of sel[C_EQUAL]
         int *sel[4];
 } coin_cfg;
 
 
 /* n-coins are coded as ints denoting the position of the false coin (1,....,n)
  * n > 0 heavy false coin, n < 0 light false coin, n = 0 no false coin
- * A set of coin solutions is terminated by INT_MAX
+ * A set of coin solutions is a slice carrying its length explicitly.
  * Initial set of possible solutions:
- * nc = {0, 1, 2, ...., n, -1, -2, ....., -n, INT_MAX}
+ * nc = {0, 1, 2, ...., n, -1, -2, ....., -n}
+ *
+ * Four representations share the coin_set type:
+ * CS_MEM  - explicit int array in the arena
+ * CS_RUN  - run-length compressed: after the first weighings sets are
+ *           long runs of consecutive coin numbers, so they are stored
+ *           as (start, count, step) intervals and expanded on the fly;
+ *           a set that fragments into too many runs is converted back
+ *           to an explicit array while being written
+ * CS_INIT - the initial set above, generated on the fly, never stored
+ * CS_FILE - spilled to an unlinked temp file when a memory budget (-M)
+ *           is set and the children of a weighing would exceed it
+ * All consumers go through the cs_iter / cs_writer functions below, so
+ * they need not know the representation.  The budget governs the
+ * possibility sets only; the per-node configuration lists of get_cfg()
+ * are kept proportional to the suspect count, which shrinks
+ * geometrically with depth, so a spilling solve peaks at O(n) bytes
+ * per thread instead of O(n * depth).
  */
-static int*
-new_coins(      int n_coins   )                                 // total number of coins
+enum{ CS_MEM = 0, CS_RUN, CS_INIT, CS_FILE };
+
+#define CS_CHUNK 4096           // ints per streaming chunk
+#define CS_RUN_MIN 1024         // minimum set size worth compressing
+
+typedef struct{
+        int v;                  // first possibility of the run
+        int n;                  // number of possibilities
+        int s;                  // step, +1 or -1
+} cs_run;
+
+typedef struct{
+        int kind;
+        int *p;                 // possibilities (CS_MEM)
+        int n;                  // number of entries
+        int cap;                // allocated entries
+        int nc;                 // total number of coins (CS_INIT)
+        int first;              // first entry, answer for solved sets
+        FILE *f;                // spill file (CS_FILE)
+        cs_run *runs;           // intervals (CS_RUN)
+        int nrun, runcap;
+} coin_set;
+
+static size_t mem_budget = 0;   // -M: memory budget in bytes, 0 - unlimited
+
+/* Puzzle variants (-v).  The solver core is possibility-driven: the
+ * classification and selection code never asks which variant is being
+ * played, the variant only determines which possibilities exist in the
+ * initial set.  "light-only" (the counterfeit can only be too light)
+ * roughly halves the possibility count, "must-exist" (a counterfeit
+ * certainly exists) drops the "no false coin" possibility.
+ */
+enum{ VAR_CLASSIC = 0, VAR_LIGHT, VAR_EXIST };
+
+static int variant = VAR_CLASSIC;
+
+static inline int
+init_count(     int n_coins     )       // size of the initial set
 {
-        int k;
-        int *poss = malloc((2 * n_coins + 2) * sizeof(int));    // all possibilities
-        
-        poss[0] = 0;                                            // no false coin
-        for(k = 1; k < n_coins + 1; k++) {
-                poss[k] = k;                                    // coin k is false and heavy
-                poss[k + n_coins] = -k;                         // coin k is false and light
+        switch(variant){
+        case VAR_LIGHT:
+                return n_coins + 1;             // 0, -1,..., -n
+        case VAR_EXIST:
+                return 2 * n_coins;             // 1,..., n, -1,..., -n
+        default:
+                return 2 * n_coins + 1;         // 0, 1,..., n, -1,..., -n
         }
-        poss[2 * n_coins + 1] = INT_MAX;                        // terminating token
-        return poss;
 }
 
-/* Size of this possibility set.
+static inline int
+init_pos(       int i,                  // index into the initial set
+                int nc          )
+{
+        switch(variant){
+        case VAR_LIGHT:
+                return -i;
+        case VAR_EXIST:
+                return i < nc ? i + 1 : nc - i - 1;
+        default:
+                return i <= nc ? i : nc - i;
+        }
+}
+
+static coin_set
+new_coins(      int n_coins   )                                 // total number of coins
+{
+        coin_set c;
+        bzero(&c, sizeof(c));
+        c.kind = CS_INIT;
+        c.n = init_count(n_coins);                              // all possibilities
+        c.nc = n_coins;
+        c.first = init_pos(0, n_coins);
+        return c;
+}
+
+/* Sequential read access to any representation.
  */
+typedef struct{
+        coin_set *s;
+        int pos;                // entries consumed so far
+        int bn, bi;             // chunk fill and cursor (CS_FILE)
+        int buf[CS_CHUNK];
+} cs_iter;
+
+static void
+cs_begin(       cs_iter *it,
+                coin_set *s     )
+{
+        it->s = s;
+        it->pos = it->bn = it->bi = 0;
+        if(s->kind == CS_FILE)
+                rewind(s->f);
+}
+
 static inline int
-npos(           const int *poss  )
+cs_next(        cs_iter *it,
+                int *v  )
+{
+        coin_set *s = it->s;
+        if(it->pos >= s->n)
+                return 0;
+        switch(s->kind){
+        case CS_MEM:
+                *v = s->p[it->pos++];
+                break;
+        case CS_RUN: {
+                cs_run *r = &s->runs[it->bi];   // bi - run index, bn - offset
+                *v = r->v + r->s * it->bn;
+                if(++it->bn == r->n) {
+                        it->bi++;
+                        it->bn = 0;
+                }
+                it->pos++;
+                break;
+        }
+        case CS_INIT:
+                *v = init_pos(it->pos++, s->nc);
+                break;
+        case CS_FILE:
+                if(it->bi >= it->bn) {
+                        it->bn = fread(it->buf, sizeof(int), CS_CHUNK, s->f);
+                        it->bi = 0;
+                }
+                *v = it->buf[it->bi++];
+                it->pos++;
+                break;
+        }
+        return 1;
+}
+
+/* Append access for building result sets; spilling writers buffer one
+ * chunk and flush it to the temp file.
+ */
+typedef struct{
+        coin_set *s;
+        int bn;                 // chunk fill (CS_FILE)
+        int buf[CS_CHUNK];
+} cs_writer;
+
+static void
+cs_wbegin(      cs_writer *w,
+                coin_set *s,
+                int cap,                // upper bound of entries
+                int spill       )
+{
+        bzero(s, sizeof(coin_set));
+        w->s = s;
+        w->bn = 0;
+        if(spill) {
+                s->kind = CS_FILE;
+                s->f = tmpfile();
+                if(s->f == NULL) {
+                        fprintf(stderr, "Cannot create spill file.\n");
+                        exit(1);
+                }
+        } else if(cap >= CS_RUN_MIN) {
+                s->kind = CS_RUN;
+                s->cap = cap;
+                s->runcap = cap / 4 + 2;        // fragmentation limit
+                s->runs = arena_alloc(s->runcap * sizeof(cs_run));
+        } else {
+                s->p = arena_alloc(cap * sizeof(int));
+                s->cap = cap;
+        }
+}
+
+/* A run-compressed set that fragments into too many intervals is
+ * expanded into an explicit array and written on from there.
+ */
+static void
+cs_expand(      coin_set *s     )
+{
+        int k, j, n = 0;
+        int *p = arena_alloc(s->cap * sizeof(int));
+        STAT_ADD(set_grows, 1);
+        for(k = 0; k < s->nrun; k++) {
+                cs_run *r = &s->runs[k];
+                for(j = 0; j < r->n; j++)
+                        p[n++] = r->v + r->s * j;
+        }
+        s->kind = CS_MEM;
+        s->p = p;
+        s->runs = NULL;
+        s->nrun = s->runcap = 0;
+}
+
+static inline void
+cs_put(         cs_writer *w,
+                int v   )
+{
+        coin_set *s = w->s;
+        if(s->n == 0)
+                s->first = v;
+        switch(s->kind){
+        case CS_FILE:
+                w->buf[w->bn++] = v;
+                if(w->bn == CS_CHUNK) {
+                        fwrite(w->buf, sizeof(int), w->bn, s->f);
+                        w->bn = 0;
+                }
+                break;
+        case CS_RUN: {
+                cs_run *r = s->nrun > 0 ? &s->runs[s->nrun - 1] : NULL;
+                if(r && r->n == 1 && (v == r->v + 1 || v == r->v - 1)) {
+                        r->s = v - r->v;        // second entry fixes the step
+                        r->n = 2;
+                } else if(r && r->n > 1 && v == r->v + r->s * r->n)
+                        r->n++;
+                else if(s->nrun < s->runcap) {  // open a new run
+                        r = &s->runs[s->nrun++];
+                        r->v = v;
+                        r->n = 1;
+                        r->s = 1;
+                } else {                        // too fragmented
+                        cs_expand(s);
+                        s->p[s->n] = v;
+                }
+                break;
+        }
+        default:
+                s->p[s->n] = v;
+                break;
+        }
+        s->n++;
+}
+
+/* Bulk append; explicit in-memory sets take a straight memcpy.
+ */
+static void
+cs_putn(        cs_writer *w,
+                const int *p,
+                int n   )
+{
+        coin_set *s = w->s;
+        int k;
+        if(n == 0)
+                return;
+        if(s->kind == CS_MEM) {
+                if(s->n == 0)
+                        s->first = *p;
+                memcpy(s->p + s->n, p, n * sizeof(int));
+                s->n += n;
+        } else
+                for(k = 0; k < n; k++)
+                        cs_put(w, p[k]);
+}
+
+static void
+cs_wend(        cs_writer *w    )
+{
+        if(w->s->kind == CS_FILE && w->bn)
+                fwrite(w->buf, sizeof(int), w->bn, w->s->f);
+}
+
+/* Release a set's spill file; in-memory sets live in the arena.
+ */
+static void
+cs_drop(        coin_set *s     )
 {
-        int np = 0;
-        while(*poss++ != INT_MAX)
-                np++;
-        return np;
+        if(s->kind == CS_FILE && s->f) {
+                fclose(s->f);
+                s->f = NULL;
+        }
 }
 
 
-/* print possibility set if its size is 1 or 0
+/* Node of the dynamic decision tree.  The solver builds this structure
+ * without printing anything; a separate renderer walks it afterwards.
+ * For each weighing result the size of the remaining possibility set
+ * is recorded, the single remaining possibility if the set is solved,
+ * and the follow-up weighing if it is not.
+ */
+typedef struct wnode{
+        int *s1, *s2;           // coins on left/right arm of balance
+        int len;                // number of coins on each side
+        int size[3];            // sizes of the three result sets
+        int coin[3];            // remaining possibility where size == 1
+        int depth;              // weighing steps required from here
+        struct wnode *child[3]; // follow-up weighings, NULL when solved
+} wnode;
+
+
+/* print a weighing result if its possibility set has size 1 or 0
  */
 static void
-print_coin(     int *poss   )
+print_result(   int size,
+                int coin   )
 {
-        switch(npos(poss)){
+        switch(size){
         case 0:
-                logd(" --");                            // impossible
+                out_str(" --");                         // impossible
                 break;
         case 1:
-                if(*poss == 0)
-                        logd(" ==");                    // no false coin
-                else if(*poss > 0)
-                        logd("%2d+", *poss);            // coin with number *poss is false and heavy
-                else
-                        logd("%2d-", -*poss);           // coin with number -*poss is false and light
+                if(coin == 0)
+                        out_str(" ==");                 // no false coin
+                else if(coin > 0) {
+                        out_int(coin, 2);               // coin with number coin is false and heavy
+                        out_char('+');
+                } else {
+                        out_int(-coin, 2);              // coin with number -coin is false and light
+                        out_char('-');
+                }
                 break;
         default:
-                logd("   ");
+                out_str("   ");
                 break;
         }
-                
+
 }
 
 
 
-static void 
-print_coins(    int **c  )
+static void
+print_results(  wnode *t  )
 {
-        if(npos(c[C_MORE]) > 1 && npos(c[C_EQUAL]) > 1 && npos(c[C_LESS]) > 1)
+        if(t->size[C_MORE] > 1 && t->size[C_EQUAL] > 1 && t->size[C_LESS] > 1)
                 return;
-        print_coin(c[C_MORE]);
-        logd(", ");
-        print_coin(c[C_EQUAL]);
-        logd(", ");
-        print_coin(c[C_LESS]);
+        print_result(t->size[C_MORE], t->coin[C_MORE]);
+        out_str(", ");
+        print_result(t->size[C_EQUAL], t->coin[C_EQUAL]);
+        out_str(", ");
+        print_result(t->size[C_LESS], t->coin[C_LESS]);
 }
                         
 
-/* Add one integer x to array s, reallocate to new size n.
- */
-static inline int*
-add_int(        int x,
-                int *s,
-                int n   )
-{
-        s = realloc(s, n * sizeof(int));
-        s[n - 1] = x;
-        return s;
-}
-
 /* Number of possible solutions for this coin configuration.
+ * Computed in long long: depth-only mode takes coin counts up to
+ * INT_MAX, where twice the double-suspect count overflows an int.
  */
-static int
+static long long
 num_pos(        coin_cfg *cfg   )
 {
-        return cfg->size[C_LESS] + cfg->size[C_MORE] + cfg->size[C_DOUBLE] * 2 + cfg->all_equal;
-} 
+        return cfg->size[C_LESS] + cfg->size[C_MORE] + cfg->size[C_DOUBLE] * 2LL + cfg->all_equal;
+}
+
+
+static int (*sel_cost)(int coin, int arm);      // selection cost model below
 
+static __thread unsigned *seen_buf = NULL;      // get_cfg stamp per coin
+static __thread char *type_buf = NULL;          // class of stamped coins
+static __thread int *sus_buf = NULL;            // suspects, first-touch order
+static __thread int type_size = 0;
+static __thread unsigned type_ver = 0;
 
 static coin_cfg*
-get_cfg(        int *c,                 // possibility set
+get_cfg(        coin_set c,             // possibility set
                 int n   )               // total number of coins
 {
-        int ci, *cl, k;
-        coin_cfg *cfg = malloc(sizeof(coin_cfg));
+        int ci = 0, j, k, n_sus = 0, fill[4] = { 0, 0, 0, 0 };
+        coin_cfg *cfg = arena_alloc(sizeof(coin_cfg));
         bzero(cfg, sizeof(coin_cfg));
-        
-        for(k = 0; k < n; k++) {
-                int hit = 0, type = C_EQUAL;
-                cl = c;
-                while((ci = *cl++) != INT_MAX) {
-                        if(ci > 0 && ((ci - 1) == k)) {
-                                hit++;
-                                type = C_MORE;
-                        } else if(ci < 0 && ((-ci - 1) == k)) {
-                                hit++;
-                                type = C_LESS;
-                        } else if(ci == 0)
-                                cfg->all_equal = 1;
-                }
-                if(hit == 2)
-                        type = C_DOUBLE;
-                cfg->sel[type] = add_int(k, cfg->sel[type], ++cfg->size[type]);
+
+        /* nothing weighed yet: every coin is the same kind of suspect
+         * (which kind depends on the variant), no need to scan the
+         * initial possibilities */
+        if(c.kind == CS_INIT) {
+                int cls = variant == VAR_LIGHT ? C_LESS : C_DOUBLE;
+                cfg->all_equal = variant != VAR_EXIST;
+                cfg->size[cls] = n;
+                for(k = 0; k < 4; k++)
+                        cfg->sel[k] = arena_alloc(cfg->size[k] * sizeof(int));
+                for(k = 0; k < n; k++)
+                        cfg->sel[cls][k] = k;
+                return cfg;
+        }
+
+        if(type_size < n) {                     // scratch, reused per node
+                free(seen_buf);
+                free(type_buf);
+                free(sus_buf);
+                seen_buf = calloc(n, sizeof(unsigned));
+                type_buf = malloc(n);
+                sus_buf = malloc(n * sizeof(int));
+                type_size = n;
+                type_ver = 0;
+        }
+        if(++type_ver == 0) {                   // stamp wrapped, start over
+                bzero(seen_buf, type_size * sizeof(unsigned));
+                type_ver = 1;
+        }
+
+        /* One pass over the possibilities: possibility +-k names coin
+         * k - 1 directly, so tally heavy and light sightings per coin;
+         * both bits together give C_MORE | C_LESS == C_DOUBLE.  A
+         * version stamp marks the coins belonging to this node, so the
+         * scratch needs no O(n) clearing and the suspects are
+         * collected as they are first seen - the rest of the work is
+         * proportional to the set, not to n.  Every set lists each
+         * sign's possibilities in coin order (the initial set and the
+         * first-weighing runs are built that way, classification keeps
+         * relative order, and a coin's heavy sighting precedes its
+         * light one wherever both survive), so each class comes out in
+         * coin order, exactly as the former full scan produced it.
+         */
+        cs_iter it;
+        cs_begin(&it, &c);
+        while(cs_next(&it, &ci)) {
+                if(ci == 0) {
+                        cfg->all_equal = 1;
+                        continue;
+                }
+                k = ci > 0 ? ci - 1 : -ci - 1;
+                if(seen_buf[k] != type_ver) {
+                        seen_buf[k] = type_ver;
+                        type_buf[k] = ci > 0 ? C_MORE : C_LESS;
+                        sus_buf[n_sus++] = k;
+                } else
+                        type_buf[k] |= ci > 0 ? C_MORE : C_LESS;
+        }
+        for(k = 0; k < n_sus; k++)
+                cfg->size[(int)type_buf[sus_buf[k]]]++;
+        cfg->size[C_EQUAL] = n - n_sus;
+
+        /* Deep in the tree nearly every coin is known good, so the N=
+         * list would dominate the per-level footprint.  The selections
+         * pad the arms with at most two good coins in case B, one in
+         * case A and a third of the suspects in case L, so only that
+         * many members are materialized; the cost model ranks every
+         * candidate and keeps the full list.
+         */
+        cfg->n_eq = cfg->size[C_EQUAL];
+        if(sel_cost == NULL && cfg->n_eq > n_sus + 2)
+                cfg->n_eq = n_sus + 2;
+        for(k = 0; k < 4; k++)
+                cfg->sel[k] = arena_alloc((k == C_EQUAL ? cfg->n_eq
+                        : cfg->size[k]) * sizeof(int));
+        for(k = 0; k < n_sus; k++) {
+                int t = type_buf[sus_buf[k]];
+                cfg->sel[t][fill[t]++] = sus_buf[k];
         }
+        for(k = j = 0; k < n && j < cfg->n_eq; k++)
+                if(seen_buf[k] != type_ver)
+                        cfg->sel[C_EQUAL][j++] = k;
         return cfg;
 }
 
-static void
-free_cfg(       coin_cfg *c     )
+/* Memoization cache for configuration shapes.
+ * Two configurations that agree in the four class sizes and the
+ * all_equal flag are identical up to coin relabeling, and the solver's
+ * choices depend only on those numbers, so they need the same number
+ * of weighings.  The cache maps the shape tuple to the subtree depth;
+ * when only the weighing count is wanted (no tree to render or export)
+ * a hit skips the whole subtree.  Shared by all solver threads.
+ */
+typedef struct{
+        int size[4];
+        int all_equal;
+        int depth;              // weighings required for this shape
+        int used;
+} shape_ent;
+
+static shape_ent *shape_tab = NULL;
+static int shape_cap = 0, shape_n = 0;
+static pthread_mutex_t shape_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int need_tree = 1;       // tree wanted beyond its depth?
+
+static inline unsigned
+shape_hash(     coin_cfg *cfg   )
 {
+        unsigned h = 2166136261u;
         int k;
         for(k = 0; k < 4; k++)
-                if(c->sel[k])
-                        free(c->sel[k]);
-        free(c);
+                h = (h ^ cfg->size[k]) * 16777619u;
+        return (h ^ cfg->all_equal) * 16777619u;
+}
+
+static inline int
+shape_match(    shape_ent *e,
+                coin_cfg *cfg   )
+{
+        return e->size[0] == cfg->size[0] && e->size[1] == cfg->size[1]
+                && e->size[2] == cfg->size[2] && e->size[3] == cfg->size[3]
+                && e->all_equal == cfg->all_equal;
+}
+
+/* Find the slot for this shape, growing the table as needed.
+ * Must be called with shape_mtx held.
+ */
+static shape_ent*
+shape_slot(     coin_cfg *cfg   )
+{
+        if(2 * shape_n >= shape_cap) {          // grow and rehash
+                shape_ent *old = shape_tab;
+                int k, oldcap = shape_cap;
+                shape_cap = shape_cap ? 2 * shape_cap : 1024;
+                shape_tab = calloc(shape_cap, sizeof(shape_ent));
+                for(k = 0; k < oldcap; k++)
+                        if(old[k].used) {
+                                coin_cfg c;
+                                memcpy(c.size, old[k].size, sizeof(c.size));
+                                c.all_equal = old[k].all_equal;
+                                unsigned j = shape_hash(&c) & (shape_cap - 1);
+                                while(shape_tab[j].used)
+                                        j = (j + 1) & (shape_cap - 1);
+                                shape_tab[j] = old[k];
+                        }
+                free(old);
+        }
+        unsigned j = shape_hash(cfg) & (shape_cap - 1);
+        while(shape_tab[j].used && !shape_match(&shape_tab[j], cfg))
+                j = (j + 1) & (shape_cap - 1);
+        return &shape_tab[j];
+}
+
+/* Swapping the N+ and N- classes mirrors the weighing arms and cannot
+ * change the depth, so both orderings share one cache entry.
+ */
+static coin_cfg
+shape_key(      coin_cfg *cfg   )
+{
+        coin_cfg key = *cfg;
+        if(key.size[C_MORE] > key.size[C_LESS]) {
+                key.size[C_MORE] = cfg->size[C_LESS];
+                key.size[C_LESS] = cfg->size[C_MORE];
+        }
+        return key;
+}
+
+static int
+shape_lookup(   coin_cfg *c,
+                int *depth      )
+{
+        coin_cfg key = shape_key(c);
+        coin_cfg *cfg = &key;
+        pthread_mutex_lock(&shape_mtx);
+        shape_ent *e = shape_slot(cfg);
+        int hit = e->used;
+        if(hit)
+                *depth = e->depth;
+        pthread_mutex_unlock(&shape_mtx);
+        return hit;
+}
+
+static void
+shape_store(    coin_cfg *c,
+                int depth       )
+{
+        coin_cfg key = shape_key(c);
+        coin_cfg *cfg = &key;
+        pthread_mutex_lock(&shape_mtx);
+        shape_ent *e = shape_slot(cfg);
+        if(!e->used) {
+                memcpy(e->size, cfg->size, sizeof(e->size));
+                e->all_equal = cfg->all_equal;
+                e->depth = depth;
+                e->used = 1;
+                shape_n++;
+        }
+        pthread_mutex_unlock(&shape_mtx);
 }
 
+static void
+shape_clear()
+{
+        pthread_mutex_lock(&shape_mtx);
+        free(shape_tab);
+        shape_tab = NULL;
+        shape_cap = shape_n = 0;
+        pthread_mutex_unlock(&shape_mtx);
+}
+
+
 static void
 print_vector(   int *c,
                 int n   )
 {
-        while(n-- > 1)
-                logd("%2d ", *c++ + 1);
+        while(n-- > 1) {
+                out_int(*c++ + 1, 2);
+                out_char(' ');
+        }
         if(n >= 0)
-                logd("%2d", *c + 1);
+                out_int(*c + 1, 2);
 }
 
 static void
@@ -248,11 +992,11 @@ print_vectors(  int *s1,
                 int *s2,
                 int k   )
 {
-        logd("(");
+        out_char('(');
         print_vector(s1, k);
-        logd(" | ");
+        out_str(" | ");
         print_vector(s2, k);
-        logd(")");
+        out_char(')');
 }
 
 
@@ -260,16 +1004,18 @@ print_vectors(  int *s1,
 static void
 print_cfg(      coin_cfg *c     )
 {
-        printf("==: %d\n", c->all_equal);
-        printf("N= :" );
-        print_vector(c->sel[C_EQUAL], c->size[C_EQUAL]);
-        printf("\nN+ :" );
+        out_str("==: ");
+        out_int(c->all_equal, 0);
+        out_str("\nN= :");
+        print_vector(c->sel[C_EQUAL], c->n_eq);
+        out_str("\nN+ :");
         print_vector(c->sel[C_MORE], c->size[C_MORE]);
-        printf("\nN- :" );
+        out_str("\nN- :");
         print_vector(c->sel[C_LESS], c->size[C_LESS]);
-        printf("\nN+-:" );
+        out_str("\nN+-:");
         print_vector(c->sel[C_DOUBLE], c->size[C_DOUBLE]);
-        printf("\n");
+        out_char('\n');
+        out_flush();
 }
 
 
@@ -345,24 +1091,120 @@ switch_more_less(       coin_cfg *c     )
 
 
 
-/*      Selections for case A
- *      Left arm of scale:      n coins from N+-
- *      Right arm of scale:     (n - l) coins from N+-, l coins from N=, if available,
- *                              else n coins from N+-
- *      returns number of coins for each side of scale
+enum{ S_OFF = 0, S_LEFT, S_RIGHT };     // scale side of a coin
+
+
+/* Selection cost model (-c moves).  The depth-optimal arithmetic of
+ * the selection cases only fixes how many coins of each class go on
+ * each arm; which members are taken is free, and by default they are
+ * taken in index order.  When loading the scale is the real cost (a
+ * robot moving physical coins), a coin that stays on the arm it
+ * occupied in the parent weighing is free while every other coin
+ * costs one move.  The active model scores a candidate (0 - free,
+ * 1 - move) and class_split() then fills each arm cheapest-first;
+ * the weighing count is untouched because only the labeling within
+ * a class changes.
  */
+static __thread char *par_arm = NULL;   // parent arm of each coin
+static __thread int par_arm_size = 0;
+
 static int
-get_sel_A(      coin_cfg *cfg,
+cost_moves(     int coin,
+                int arm         )
+{
+        return par_arm[coin] != arm;
+}
+
+static int (*sel_cost)(int coin, int arm) = NULL;       // NULL - index order
+
+static void
+par_load(       wnode *par,             // NULL for the root weighing
+                int nc  )
+{
+        int j;
+        if(par_arm_size < nc) {
+                free(par_arm);
+                par_arm = calloc(nc, 1);
+                par_arm_size = nc;
+        }
+        if(par == NULL)
+                return;
+        for(j = 0; j < par->len; j++) {
+                par_arm[par->s1[j]] = S_LEFT;
+                par_arm[par->s2[j]] = S_RIGHT;
+        }
+}
+
+static void
+par_unload(     wnode *par      )
+{
+        int j;
+        if(par == NULL)
+                return;
+        for(j = 0; j < par->len; j++) {
+                par_arm[par->s1[j]] = S_OFF;
+                par_arm[par->s2[j]] = S_OFF;
+        }
+}
+
+/* Distribute one coin class over the arms: nl coins to d1, nr to d2,
+ * the rest stays off the scale.  Pass 0 keeps coins on their parent
+ * arm where the model rates that free, pass 1 fills the remaining
+ * places in index order; without a model a single pass reproduces the
+ * canonical index-order split exactly.
+ */
+static void
+class_split(    int *sel,               // coin class, index order
+                int size,
+                int nl,
+                int *d1,
+                int nr,
+                int *d2         )
+{
+        int j, pass, i1 = 0, i2 = 0;
+
+        if(sel_cost == NULL) {
+                for(j = 0; j < nl; j++)
+                        d1[j] = sel[j];
+                for(j = 0; j < nr; j++)
+                        d2[j] = sel[nl + j];
+                return;
+        }
+        char *used = arena_alloc(size);
+        bzero(used, size);
+        for(pass = 0; pass < 2; pass++)
+                for(j = 0; j < size && (i1 < nl || i2 < nr); j++) {
+                        if(used[j])
+                                continue;
+                        if(i1 < nl && (pass || sel_cost(sel[j], S_LEFT) == 0)) {
+                                d1[i1++] = sel[j];
+                                used[j] = 1;
+                        } else if(i2 < nr && (pass || sel_cost(sel[j], S_RIGHT) == 0)) {
+                                d2[i2++] = sel[j];
+                                used[j] = 1;
+                        }
+                }
+}
+
+
+/*      Selections for case A
+ *      Left arm of scale:      n coins from N+-
+ *      Right arm of scale:     (n - l) coins from N+-, l coins from N=, if available,
+ *                              else n coins from N+-
+ *      returns number of coins for each side of scale
+ */
+static int
+get_sel_A(      coin_cfg *cfg,
                 int **s1,                               // coins for left arm of scale
                 int **s2        )                       // coins for right arm of scale
 {
-        int m = cfg->size[C_DOUBLE], l = 0, n = 0, j;
-        
+        int m = cfg->size[C_DOUBLE], l = 0, n = 0;
+
         switch(m % 3){
         case 0:
                 n = m / 3;
                 break;
-        case 1: 
+        case 1:
                 if(cfg->size[C_EQUAL]) {
                         n = (m + 2) / 3;
                         l = 1;
@@ -377,17 +1219,11 @@ get_sel_A(      coin_cfg *cfg,
 
         *s1 = malloc(n * sizeof(int));
         *s2 = malloc(n * sizeof(int));
-        
-        for(j = 0; j < n; j++)
-                (*s1)[j] = cfg->sel[C_DOUBLE][j];
-        if(l == 0) {
-                for(j = 0; j < n; j++)
-                        (*s2)[j] = cfg->sel[C_DOUBLE][j + n];
-        } else {
-                for(j = 0; j < n - 1; j++)
-                        (*s2)[j] = cfg->sel[C_DOUBLE][j + n];
-                (*s2)[n - 1] = cfg->sel[C_EQUAL][0];
-        }
+
+        class_split(cfg->sel[C_DOUBLE], m, n, *s1, n - l, *s2);
+        if(l > 0)
+                class_split(cfg->sel[C_EQUAL], cfg->n_eq,
+                        0, NULL, l, *s2 + n - l);
         return n;
 }
         
@@ -409,44 +1245,88 @@ get_sel_B(      coin_cfg *cfg,
                         return 0;
         }
         
-        int n_more = cfg->size[C_MORE], 
-                n1 = r[0], n2 = r[1], k = r[2], l = r[3], ns, j, i;
-        
+        int n_more = cfg->size[C_MORE],
+                n1 = r[0], n2 = r[1], k = r[2], l = r[3], ns;
+
         ns = n1 + n2 + (l < 0 ? -l : 0);
         *s1 = malloc(ns * sizeof(int));
         *s2 = malloc(ns * sizeof(int));
-        
-        for(j = 0; j < n1; j++)
-                (*s1)[j] = cfg->sel[C_MORE][j];
-        for(; j < n1 + n2; j++)
-                (*s1)[j] = cfg->sel[C_LESS][j - n1];
+
+        class_split(cfg->sel[C_MORE], n_more, n1, *s1, n_more - n1, *s2);
+        class_split(cfg->sel[C_LESS], cfg->size[C_LESS],
+                n2, *s1 + n1, k, *s2 + n_more - n1);
         if(l < 0)
-                (*s1)[j] = cfg->sel[C_EQUAL][0];
-        
-        for(j = 0; j < n_more - n1; j++)
-                (*s2)[j] = cfg->sel[C_MORE][j + n1];
-        for(; j < n_more - n1 + k; j++)
-                (*s2)[j] = cfg->sel[C_LESS][j - (n_more - n1) + n2];
-        for(i = 0; i < l; i++)
-                (*s2)[j++] = cfg->sel[C_EQUAL][i];
+                class_split(cfg->sel[C_EQUAL], cfg->n_eq,
+                        -l, *s1 + n1 + n2, 0, NULL);
+        else if(l > 0)
+                class_split(cfg->sel[C_EQUAL], cfg->n_eq,
+                        0, NULL, l, *s2 + n_more - n1 + k);
 
         return ns;
 }
 
 
-/*      Determine configuration type (A or B), select and apply suitable strategy.
+/*      Selections for case L (one-sided variants): every suspect sits in
+ *      N- alone (or N+ alone, handled by symmetry) and "no false coin"
+ *      is still possible.  With np = N- + 1 possibilities, putting
+ *      n2 = ceil(np / 3) suspects on the left arm and k suspects plus
+ *      l = n2 - k good coins on the right splits every branch to at
+ *      most ceil(np / 3) possibilities, which is optimal.  Only the
+ *      initial configuration lacks good coins for padding; there n2 is
+ *      lowered until both arms can be filled from N- alone.
+ */
+static int
+get_sel_L(      coin_cfg *cfg,
+                int **s1,                       // coins for left arm of scale
+                int **s2        )               // coins for right arm of scale
+{
+        if(cfg->size[C_LESS] == 0)
+                switch_more_less(cfg);
+
+        int n_less = cfg->size[C_LESS],
+                np = n_less + 1,                // suspects plus "all good"
+                n2 = (np + 2) / 3, k, l;
+
+        k = n_less - n2 < n2 ? n_less - n2 : n2;
+        l = n2 - k;
+        if(l > cfg->size[C_EQUAL]) {            // not enough good padding
+                n2 -= l - cfg->size[C_EQUAL];
+                k = n_less - n2 < n2 ? n_less - n2 : n2;
+                l = n2 - k;
+        }
+        if(n2 <= 0)
+                return 0;
+
+        *s1 = malloc(n2 * sizeof(int));
+        *s2 = malloc(n2 * sizeof(int));
+
+        class_split(cfg->sel[C_LESS], n_less, n2, *s1, k, *s2);
+        if(l > 0)
+                class_split(cfg->sel[C_EQUAL], cfg->n_eq,
+                        0, NULL, l, *s2 + k);
+
+        return n2;
+}
+
+
+/*      Determine configuration type (A, B or L), select and apply suitable strategy.
  */
 static int
 getselection(   coin_cfg *cfg,
                 int **s1,
                 int **s2        )
 {
-        if(cfg->size[C_MORE] == 0 && cfg->size[C_LESS] == 0 && cfg->all_equal)
+        if(cfg->size[C_MORE] == 0 && cfg->size[C_LESS] == 0
+                        && (cfg->all_equal || cfg->size[C_DOUBLE] > 0))
                 return get_sel_A(cfg, s1, s2);
-        
+
         if(cfg->size[C_DOUBLE] == 0 && !cfg->all_equal)
                 return get_sel_B(cfg, s1, s2);
-        
+
+        if(cfg->size[C_DOUBLE] == 0 && cfg->all_equal
+                        && (cfg->size[C_MORE] == 0 || cfg->size[C_LESS] == 0))
+                return get_sel_L(cfg, s1, s2);
+
         printf("Cannot handle this configuration: \n");
         print_cfg(cfg);
         printf("\n");
@@ -455,57 +1335,327 @@ getselection(   coin_cfg *cfg,
         
 
 
-                        
-/*  Add weighs of len coins from set c
- *  return 0 if all coins have correct weight,
- *  1 if heavier, -1 if lighter
+
+/* Scale side of each coin during one weighing, indexed by coin number
+ * 1,..., total_num_coins: 0 - off scale, 1 - left arm, 2 - right arm.
+ * Entries are set from the selections before classifying and cleared
+ * again afterwards, so each weighing costs O(len), not O(n).
+ * Kept as ints so the vector kernel can gather from it.
  */
-static inline int
-sum(    const int c,                // possible coin set
-        const int *s,               // selection of coins (0,..., total_num_coins - 1)
-        const int len         )     // size of selection
+static __thread int *side = NULL;
+static __thread int side_size = 0;
+
+
+/* Classification kernels: partition a block of possibilities into
+ * three output buffers according to the side table.  The AVX2 variant
+ * gathers the side codes for 8 possibilities at once and left-packs
+ * each class with a shuffle-table compress store; it is selected at
+ * runtime, the scalar version is the portable fallback.
+ * classify_init() runs once at startup next to trit_init(), before
+ * any solver thread exists, so the kernel pointer and the shuffle
+ * table are never written concurrently.
+ */
+static void (*classify_block)(const int*, int, int**, int*, const int*) = NULL;
+
+static void
+classify_block_scalar(  const int *p,           // possibilities
+                        int n,
+                        int **out,              // three class buffers
+                        int *cnt,               // fill counts
+                        const int *tbl  )       // side table
 {
         int k;
-        for(k = 0; k < len; k++) {
-                if(c > 0 && (c - 1) == s[k])
-                        return 1;
-                else if(c < 0 && (-c - 1) == s[k])
-                        return -1;
+        for(k = 0; k < n; k++) {
+                int v = p[k];
+                int s = tbl[v >= 0 ? v : -v];           // side of the suspect coin
+                int w = v > 0 ? 1 : (v < 0 ? -1 : 0);   // its weight deviation
+                int bal = balance(s == S_LEFT ? w : 0, s == S_RIGHT ? w : 0);
+                out[bal][cnt[bal]++] = v;
         }
-        return 0;
+}
+
+#if defined(__x86_64__)
+
+static int compress_idx[256][8];        // lane indices per 8-bit mask
+
+__attribute__((target("avx2")))
+static void
+classify_block_avx2(    const int *p,
+                        int n,
+                        int **out,
+                        int *cnt,
+                        const int *tbl  )
+{
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i left = _mm256_set1_epi32(S_LEFT);
+        const __m256i right = _mm256_set1_epi32(S_RIGHT);
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i mone = _mm256_set1_epi32(-1);
+        const __m256i two = _mm256_set1_epi32(2);
+        int k, j;
+
+        for(k = 0; k + 8 <= n; k += 8) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(p + k));
+                __m256i s = _mm256_i32gather_epi32(tbl, _mm256_abs_epi32(v), 4);
+                /* weight deviation w: +1 heavy, -1 light, 0 none */
+                __m256i w = _mm256_sub_epi32(_mm256_cmpgt_epi32(zero, v),
+                                             _mm256_cmpgt_epi32(v, zero));
+                __m256i l = _mm256_and_si256(_mm256_cmpeq_epi32(s, left), w);
+                __m256i r = _mm256_and_si256(_mm256_cmpeq_epi32(s, right), w);
+                __m256i d = _mm256_sub_epi32(l, r);
+                /* balance: d = 1 -> C_MORE, d = -1 -> C_LESS, 0 -> C_EQUAL */
+                __m256i bal = _mm256_add_epi32(
+                        _mm256_and_si256(_mm256_cmpeq_epi32(d, one), one),
+                        _mm256_and_si256(_mm256_cmpeq_epi32(d, mone), two));
+                for(j = 0; j < 3; j++) {
+                        __m256i m = _mm256_cmpeq_epi32(bal, _mm256_set1_epi32(j));
+                        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(m));
+                        __m256i idx = _mm256_loadu_si256(
+                                (const __m256i*)compress_idx[mask]);
+                        _mm256_storeu_si256((__m256i*)(out[j] + cnt[j]),
+                                _mm256_permutevar8x32_epi32(v, idx));
+                        cnt[j] += __builtin_popcount(mask);
+                }
+        }
+        classify_block_scalar(p + k, n - k, out, cnt, tbl);     // tail
+}
+
+#endif
+
+static void
+classify_init()
+{
+#if defined(__x86_64__)
+        if(__builtin_cpu_supports("avx2")) {
+                int m, b, j;
+                for(m = 0; m < 256; m++) {
+                        for(b = j = 0; b < 8; b++)
+                                if(m >> b & 1)
+                                        compress_idx[m][j++] = b;
+                        for(; j < 8; j++)
+                                compress_idx[m][j] = 0;
+                }
+                classify_block = classify_block_avx2;
+                return;
+        }
+#endif
+        classify_block = classify_block_scalar;
+}
+
+/* Assemble a run-compressed set from prepared intervals.
+ */
+static void
+cs_make(        coin_set *s,
+                cs_run *runs,           // arena-allocated
+                int nrun        )
+{
+        int k;
+        bzero(s, sizeof(coin_set));
+        s->kind = CS_RUN;
+        s->runs = runs;
+        s->nrun = s->runcap = nrun;
+        for(k = 0; k < nrun; k++)
+                s->n += runs[k].n;
+        s->cap = s->n;
+        s->first = nrun > 0 ? runs[0].v : 0;
+}
+
+static inline void
+cs_setrun(      cs_run *r,
+                int v,
+                int n,
+                int s   )
+{
+        r->v = v;
+        r->n = n;
+        r->s = s;
 }
 
 /*      Perform a weighing of coins.
 */
 void
-weigh(  int *c,                 // base set of possibilities
+weigh(  coin_set c,             // base set of possibilities
         int *s1,                // coins on left side of scale (0,....., total_num_coins - 1)
         int *s2,                // coins on right side of scale (0,....., total_num_coins - 1)
         int len,                // number of coins on each side
-        int **r         )       // results
+        int nc,                 // total number of coins
+        coin_set *r     )       // results
 {
-        int ci, n[3], k;
-        r[C_EQUAL] = r[C_MORE] = r[C_LESS] = NULL;
-        n[0] = n[1] = n[2] = 0;
-        while((ci = *c++) != INT_MAX) {
-                int bal = balance(sum(ci, s1, len), sum(ci, s2, len));
-                r[bal] = add_int(ci, r[bal], ++n[bal]);
+        int k, done;
+        cs_iter it;
+        cs_writer w[3];
+        int ob[3][CS_CHUNK + 8];        // slack for the 8-wide compress store
+        int buf[CS_CHUNK];
+        int *out[3] = { ob[0], ob[1], ob[2] };
+
+        STAT_TICK(t0);
+        STAT_ADD(weighings, 1);
+        STAT_ADD(classified, c.n);
+
+        /* First-weighing fast path: the initial selection always puts
+         * coins 0,..., len - 1 left and len,..., 2 * len - 1 right, so
+         * the three result sets are closed-form intervals of the
+         * possibility range - synthesize them as runs instead of
+         * classifying all 2n + 1 possibilities.  The selections are
+         * sorted, so comparing the endpoints is enough.
+         */
+        if(c.kind == CS_INIT && len > 0 && s1[0] == 0
+                        && s1[len - 1] == len - 1 && s2[0] == len
+                        && s2[len - 1] == 2 * len - 1) {
+                int rest = nc - 2 * len;        // coins left off the scale
+                int na = 0, nb = 0, nq = 0;
+                cs_run *ra = arena_alloc(2 * sizeof(cs_run));
+                cs_run *rb = arena_alloc(2 * sizeof(cs_run));
+                cs_run *rc = arena_alloc(3 * sizeof(cs_run));
+                if(variant != VAR_LIGHT) {
+                        cs_setrun(&ra[na++], 1, len, 1);        // left coin heavy
+                        cs_setrun(&rb[nb++], -1, len, -1);      // left coin light
+                        cs_setrun(&ra[na++], -(len + 1), len, -1); // right coin light
+                        cs_setrun(&rb[nb++], len + 1, len, 1);  // right coin heavy
+                } else {
+                        cs_setrun(&ra[na++], -(len + 1), len, -1);
+                        cs_setrun(&rb[nb++], -1, len, -1);
+                }
+                if(variant != VAR_EXIST)
+                        cs_setrun(&rc[nq++], 0, 1, 1);          // no false coin
+                if(rest > 0) {
+                        if(variant != VAR_LIGHT)
+                                cs_setrun(&rc[nq++], 2 * len + 1, rest, 1);
+                        cs_setrun(&rc[nq++], -(2 * len + 1), rest, -1);
+                }
+                cs_make(&r[C_MORE], ra, na);
+                cs_make(&r[C_LESS], rb, nb);
+                cs_make(&r[C_EQUAL], rc, nq);
+                STAT_TOCK(ns_classify, t0);
+                return;
+        }
+
+        /* spill the result sets past the memory budget */
+        int spill = mem_budget > 0 &&
+                arena_inuse() + 3 * (size_t)c.n * sizeof(int) > mem_budget;
+        for(k = 0; k < 3; k++)                  // each result holds at most c.n entries
+                cs_wbegin(&w[k], &r[k], c.n, spill);
+
+        if(side_size < nc + 1) {
+                free(side);
+                side = calloc(nc + 1, sizeof(int));
+                side_size = nc + 1;
+        }
+        for(k = 0; k < len; k++) {
+                side[s1[k] + 1] = S_LEFT;
+                side[s2[k] + 1] = S_RIGHT;
+        }
+        /* classify one chunk at a time; explicit arrays in place */
+        cs_begin(&it, &c);
+        for(done = 0; done < c.n; ) {
+                const int *bp;
+                int cnt[3] = { 0, 0, 0 }, nb;
+                if(c.kind == CS_MEM) {
+                        nb = c.n - done > CS_CHUNK ? CS_CHUNK : c.n - done;
+                        bp = c.p + done;
+                } else {
+                        for(nb = 0; nb < CS_CHUNK && cs_next(&it, &buf[nb]); nb++)
+                                ;
+                        bp = buf;
+                }
+                classify_block(bp, nb, out, cnt, side);
+                for(k = 0; k < 3; k++)
+                        cs_putn(&w[k], out[k], cnt[k]);
+                done += nb;
+        }
+        for(k = 0; k < len; k++) {
+                side[s1[k] + 1] = S_OFF;
+                side[s2[k] + 1] = S_OFF;
         }
         for(k = 0; k < 3; k++)
-                r[k] = add_int(INT_MAX, r[k], ++n[k]);
+                cs_wend(&w[k]);
+        STAT_TOCK(ns_classify, t0);
 }
 
 
 static int ident = 0;
 static char *prefix = "";
 
+
+/* Worker pool for parallel subtree solving (-j N).  The three subtrees
+ * produced by a weighing are independent; build_tree() hands up to
+ * two of them to fresh threads while solving the rest itself.  A counter
+ * bounds the number of extra threads alive at any time; slots freed by
+ * finished workers are reused at any depth of the tree.
+ */
+#define PAR_THRESHOLD 256               // minimum set size worth a thread
+
+static int n_jobs = 1;                  // -j: total solver threads
+static int jobs_free = 0;               // extra threads still available
+static pthread_mutex_t job_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+acquire_job()
+{
+        int ok = 0;
+        pthread_mutex_lock(&job_mtx);
+        if(jobs_free > 0) {
+                jobs_free--;
+                ok = 1;
+        }
+        pthread_mutex_unlock(&job_mtx);
+        return ok;
+}
+
+static void
+release_job()
+{
+        pthread_mutex_lock(&job_mtx);
+        jobs_free++;
+        pthread_mutex_unlock(&job_mtx);
+}
+
+typedef struct{
+        coin_set c;                     // subtree possibility set
+        int nc;                         // total number of coins
+        wnode *par;                     // weighing that produced the set
+        wnode *node;                    // resulting decision subtree
+} subtree_task;
+
+static wnode*
+build_tree(     coin_set c,
+                int nc,
+                wnode *par      );
+
+static void*
+subtree_worker( void *arg       )
+{
+        subtree_task *t = arg;
+
+        arena_init();
+        t->node = build_tree(t->c, t->nc, t->par);
+        arena_free();
+        free(side);
+        side = NULL;
+        side_size = 0;
+        free(par_arm);
+        par_arm = NULL;
+        par_arm_size = 0;
+        free(seen_buf);
+        seen_buf = NULL;
+        free(type_buf);
+        type_buf = NULL;
+        free(sus_buf);
+        sus_buf = NULL;
+        type_size = 0;
+        type_ver = 0;
+        STATS_FLUSH();
+        release_job();
+        return NULL;
+}
+
 static void
 print_ident()
 {
         int k;
         for(k = 0; k < ident; k++)
-                logd("    ");
-        logd(prefix);
+                out_str("    ");
+        out_str(prefix);
 }
 
 static inline int
@@ -518,205 +1668,841 @@ max3(   int a,
 }
 
 
-static int
-weigh_sequential(       int *c,                 // possibilities
-                        int nc  );              // number of coins
+/* Iterative tree builder.  Pending subtrees sit on an explicit LIFO
+ * worklist instead of the C stack, so skewed trees cannot overflow it
+ * and a pending entry costs a few words instead of a full frame.  An
+ * entry is either an expansion (a possibility set plus the parent link
+ * to hang the result on) or, with frame set, the finish step of an
+ * already expanded node: it is pushed below the node's children, pops
+ * after the whole subtree is done, and performs what the recursive
+ * version did after returning from the children - join spawned
+ * workers, compute the depth, feed the shape cache and pop the arena
+ * frame.  LIFO order reproduces the depth-first arena discipline
+ * exactly; large child sets are still handed to pool threads at
+ * expansion time, each running its own worklist.
+ */
+typedef struct{
+        coin_cfg *cfg;                  // for the shape cache
+        coin_set cr[3];                 // result sets to drop
+        arena_state as;                 // frame to pop
+        int spawned[3];
+        pthread_t tid[3];
+        subtree_task t[3];
+} wframe;
+
+typedef struct{
+        coin_set c;                     // possibilities (expansion)
+        wnode **slot;                   // parent link for the subtree
+        wnode *node;                    // expanded node (finish)
+        wnode *par;                     // weighing that produced the set
+        wframe *f;                      // NULL for expansions
+} witem;
+
+static wnode*
+build_tree(     coin_set c,             // possibilities
+                int nc,                 // number of coins
+                wnode *par      )       // parent weighing, NULL at the root
+{
+        int cap = 64, top = 0, j;
+        witem *wl = malloc(cap * sizeof(witem));
+        wnode *root = NULL;
+
+        wl[top].c = c;
+        wl[top].slot = &root;
+        wl[top].par = par;
+        wl[top].f = NULL;
+        top++;
+
+        while(top > 0) {
+                witem w = wl[--top];
+
+                if(w.f != NULL) {               // finish an expanded node
+                        wframe *f = w.f;
+                        for(j = 0; j < 3; j++)
+                                if(f->spawned[j]) {
+                                        pthread_join(f->tid[j], NULL);
+                                        w.node->child[j] = f->t[j].node;
+                                }
+                        for(j = 0; j < 3; j++)
+                                cs_drop(&f->cr[j]);
+                        w.node->depth = 1 + max3(
+                                w.node->child[0] ? w.node->child[0]->depth : 0,
+                                w.node->child[1] ? w.node->child[1]->depth : 0,
+                                w.node->child[2] ? w.node->child[2]->depth : 0);
+                        shape_store(f->cfg, w.node->depth);
+                        arena_restore(f->as);
+                        free(f);
+                        continue;
+                }
+
+                arena_state as = arena_save();
+                coin_cfg *cfg = get_cfg(w.c, nc);
+                if(num_pos(cfg) <= 1) {         // solved, no node needed
+                        arena_restore(as);
+                        *w.slot = NULL;
+                        continue;
+                }
+
+                /* a known shape tells the depth without expanding the
+                 * subtree, unless the tree itself is wanted */
+                int depth;
+                if(!need_tree && shape_lookup(cfg, &depth)) {
+                        arena_restore(as);
+                        wnode *node = calloc(1, sizeof(wnode));
+                        node->depth = depth;
+                        *w.slot = node;
+                        continue;
+                }
+
+                /* determine optimum selection of coins for left (s1) and right (s2) side of balance */
+                STAT_TICK(t0);
+                if(sel_cost != NULL)
+                        par_load(w.par, nc);
+                int *s1 = NULL, *s2 = NULL;
+                int n_sel = getselection(cfg, &s1, &s2);
+#ifdef COIN_STATS
+                if(sel_cost != NULL) {
+                        long long m = 0;
+                        for(j = 0; j < n_sel; j++)
+                                m += sel_cost(s1[j], S_LEFT)
+                                   + sel_cost(s2[j], S_RIGHT);
+                        STAT_ADD(coin_moves, m);
+                }
+#endif
+                if(sel_cost != NULL)
+                        par_unload(w.par);
+                STAT_TOCK(ns_select, t0);
+                if(n_sel <= 0) {
+                        printf("Error\n");
+                        exit(0);
+                }
+
+                wframe *f = malloc(sizeof(wframe));
+                f->cfg = cfg;
+                f->as = as;
+
+                /* create possibility sets for the three weighing results */
+                weigh(w.c, s1, s2, n_sel, nc, f->cr);
+
+                wnode *node = malloc(sizeof(wnode));
+                node->s1 = s1;
+                node->s2 = s2;
+                node->len = n_sel;
+                *w.slot = node;
+                for(j = 0; j < 3; j++) {
+                        node->size[j] = f->cr[j].n;
+                        node->coin[j] = f->cr[j].n == 1 ? f->cr[j].first : 0;
+                }
+
+                if(top + 4 > cap) {
+                        cap *= 2;
+                        wl = realloc(wl, cap * sizeof(witem));
+                }
+                wl[top].c = c;                  // finish below the children
+                wl[top].slot = NULL;
+                wl[top].node = node;
+                wl[top].f = f;
+                top++;
+
+                for(j = 0; j < 3; j++) {
+                        f->spawned[j] = 0;
+                        if(j < 2 && n_jobs > 1 && f->cr[j].n >= PAR_THRESHOLD
+                                        && acquire_job()) {
+                                f->t[j].c = f->cr[j];
+                                f->t[j].nc = nc;
+                                f->t[j].par = node;
+                                pthread_create(&f->tid[j], NULL,
+                                        subtree_worker, &f->t[j]);
+                                f->spawned[j] = 1;
+                        } else {
+                                wl[top].c = f->cr[j];
+                                wl[top].slot = &node->child[j];
+                                wl[top].par = node;
+                                wl[top].f = NULL;
+                                top++;
+                        }
+                }
+        }
+        free(wl);
+        return root;
+}
 
 
-/* Apply weighing to possibility set, and split it into three sets
- * depending on weighing results.
- * These are then weighed and splitted recursively
+/* Render the decision tree in the established text format.
  */
 static int
-split_selection(        int *c,                 // possibilities
-                        int nc,                 // number of coins
-                        int *s1,                // coins on left arm of balance
-                        int *s2,                // coins on right side of balance
-                        int k           )       // size of selection
+print_tree(     wnode *t        )
 {
-        int r1, r2, r3, *cr[3];
-        
-        /* create possibility sets for the three weighing results */
-        weigh(c, s1, s2, k, cr);
-        free(c);
-                        
-        /* print results */
+        int r1, r2, r3;
+
+        if(t == NULL)
+                return 0;
+
+        if(ident == 0)          // fresh render: drop the previous tree's prefix
+                prefix = "";
         ident++;
         print_ident();
-        print_vectors(s1, s2, k);
-        logd(" [%d, %d, %d] ", npos(cr[C_MORE]), npos(cr[C_EQUAL]), npos(cr[C_LESS]));
-        print_coins(cr);
-        logd("\n");
-        
-        /* recursively call weigh_sequential on the three results */
+        print_vectors(t->s1, t->s2, t->len);
+        out_str(" [");
+        out_int(t->size[C_MORE], 0);
+        out_str(", ");
+        out_int(t->size[C_EQUAL], 0);
+        out_str(", ");
+        out_int(t->size[C_LESS], 0);
+        out_str("] ");
+        print_results(t);
+        out_char('\n');
+
         prefix = "+";
-        r1 = weigh_sequential(cr[C_MORE], nc);
+        r1 = print_tree(t->child[C_MORE]);
         prefix = "=";
-        r2 = weigh_sequential(cr[C_EQUAL], nc);
+        r2 = print_tree(t->child[C_EQUAL]);
         prefix = "-";
-        r3 = weigh_sequential(cr[C_LESS], nc);
-        
+        r3 = print_tree(t->child[C_LESS]);
+
         ident--;
         /* return number of weighing steps required */
         return 1 + max3(r1, r2, r3);
-}                        
-
+}
 
 
-static int
-weigh_sequential(       int *c,                 // coins
-                        int nc  )               // number of coins
+/* Render the decision tree as JSON, one record per line (-f json).
+ * Records leave the buffered writer in preorder, so a consumer can
+ * start parsing while a large tree is still being printed instead of
+ * buffering the whole dump.  Selections are compressed to inclusive
+ * [first, last] coin ranges; a solved branch carries its remaining
+ * possibility in "answers" (positive - coin too heavy, negative - too
+ * light, 0 - no false coin, null - open or impossible branch).
+ */
+static void
+out_ranges(     int *c,
+                int n   )
 {
-        
-        coin_cfg *cfg = get_cfg(c, nc);
-        if(num_pos(cfg) <= 1) {                 // we're finished
-                free(c);
-                free_cfg(cfg);
-                return 0;
+        int j, lo;
+        out_char('[');
+        for(j = 0; j < n; j++) {
+                lo = j;
+                while(j + 1 < n && c[j + 1] == c[j] + 1)
+                        j++;
+                if(lo > 0)
+                        out_char(',');
+                out_char('[');
+                out_int(c[lo] + 1, 0);
+                out_char(',');
+                out_int(c[j] + 1, 0);
+                out_char(']');
         }
-        
-        /* determine optimum selection of coins for left (sl1) and right (sl2) side of balance */
-        int *sl1, *sl2, n_sel = getselection(cfg, &sl1, &sl2);
-        if(n_sel > 0) {
-                int r = split_selection(c, nc, sl1, sl2, n_sel);
-                free(sl1);
-                free(sl2);
-                free_cfg(cfg);
-                return r;
-        }
-        printf("Error\n");        
-        exit(0);
+        out_char(']');
 }
 
-/* Static weigh strategy 
-* See http://paulbourke.net/fun/counterfeit.html for the terms used
-* The saturated case (number of coins) = (3^(number of weighings) - 1) / 2 - 1
-* is determined algorithmically, the other cases are solved by extending
-* the closest saturated case.
-*/
+static int json_id = 0;
 
-static inline int
-ipow(   int x,
-        int n   )
+static void
+json_node(      wnode *t,
+                int parent,
+                const char *branch      )
 {
-        int r = 1;
-        while(n--)
-                r *= x;
-        return r;
+        static const int ord[3] = { C_MORE, C_EQUAL, C_LESS };
+        static const char *tag[3] = { "+", "=", "-" };
+        int id = json_id++, j;
+
+        out_str("{\"id\":");
+        out_int(id, 0);
+        out_str(",\"parent\":");
+        if(parent < 0)
+                out_str("null");
+        else
+                out_int(parent, 0);
+        out_str(",\"branch\":");
+        if(branch == NULL)
+                out_str("null");
+        else {
+                out_char('"');
+                out_str(branch);
+                out_char('"');
+        }
+        out_str(",\"depth\":");
+        out_int(t->depth, 0);
+        out_str(",\"left\":");
+        out_ranges(t->s1, t->len);
+        out_str(",\"right\":");
+        out_ranges(t->s2, t->len);
+        out_str(",\"sizes\":[");
+        for(j = 0; j < 3; j++) {
+                if(j > 0)
+                        out_char(',');
+                out_int(t->size[ord[j]], 0);
+        }
+        out_str("],\"answers\":[");
+        for(j = 0; j < 3; j++) {
+                if(j > 0)
+                        out_char(',');
+                if(t->size[ord[j]] == 1 && t->child[ord[j]] == NULL)
+                        out_int(t->coin[ord[j]], 0);
+                else
+                        out_str("null");
+        }
+        out_str("]}\n");
+        for(j = 0; j < 3; j++)
+                if(t->child[ord[j]] != NULL)
+                        json_node(t->child[ord[j]], id, tag[j]);
 }
 
-/* Base 3 complement of x :  turn 1s into 2s and vice versa
- */
-static int
-op(     int x   )
+static void
+print_tree_json(        wnode *t,
+                        int nc  )
 {
-        int c = 1, s = 0;
-        for(; x; x /= 3, c *= 3) {
-                switch(x % 3){
-                case 1:
-                        s += 2 * c;
-                        break;
-                case 2:
-                        s += c;
-                        break;
-                }
-        }
-        return s;
+        out_str("{\"type\":\"strategy\",\"mode\":\"dynamic\",\"coins\":");
+        out_int(nc, 0);
+        out_str(",\"weighings\":");
+        out_int(t ? t->depth : 0, 0);
+        out_str("}\n");
+        json_id = 0;
+        if(t != NULL)
+                json_node(t, -1, NULL);
+        out_flush();
 }
 
-/* Base 3 digit of x at position n (n = 0: rightmost)
- */
-static inline int
-digit(  int x,
-        int n   )        
+
+static void
+free_tree(      wnode *t        )
 {
-        while(n-- > 0)
-                x /= 3;
-        return x % 3;
+        int j;
+        if(t == NULL)
+                return;
+        for(j = 0; j < 3; j++)
+                free_tree(t->child[j]);
+        free(t->s1);
+        free(t->s2);
+        free(t);
 }
 
-/* Given heavy-codes hcode (size nc), check if
- * t or op(t) is contained, fail if yes.
+
+/* Binary strategy files (-o file).  The layout is flat and offset-
+ * based, so a reader can mmap() the file read-only and follow record
+ * indices without any parsing or relocation:
+ *      strat_hdr
+ *      dynamic: count node records followed by all side arrays; a
+ *               record stores the int offset of its s1 in the side
+ *               area, s2 follows immediately
+ *      static:  count sorted heavy-codes
+ * Answers use the possibility encoding of the solver: +k coin k is
+ * too heavy, -k coin k is too light, 0 no false coin.
  */
+#define STRAT_MAGIC 0x4e494f43          // "COIN"
+enum{ STRAT_DYNAMIC = 1, STRAT_STATIC };
+
+static char *out_file = NULL;           // -o: export the strategy here
+
+typedef struct{
+        int magic;
+        int type;               // STRAT_DYNAMIC or STRAT_STATIC
+        int n_coins;
+        int k;                  // number of weighings
+        int count;              // node records resp. heavy-codes
+} strat_hdr;
+
+typedef struct{
+        int len;                // coins per side
+        int size[3];            // per weighing result, as in wnode
+        int coin[3];
+        int child[3];           // record index, -1 when solved
+        long soff;              // int offset of s1 in the side area
+} strat_node;
+
 static int
-isfree(         int t, 
-                int *hcode, 
-                int nc  )
+strat_count(    wnode *t        )
 {
-        int j;
-        for(j = 0; j < nc; j++)
-                if(t == hcode[j] || t == op(hcode[j]))
-                        return 0;
-        return 1;
+        if(t == NULL)
+                return 0;
+        return 1 + strat_count(t->child[0]) + strat_count(t->child[1])
+                 + strat_count(t->child[2]);
 }
 
-
-/* Utility function for getbase
- * Given heavy codes b (size n) find a number that isfree
+/* Flatten the tree into the record array in preorder; children become
+ * record indices and the side arrays become offsets into the side
+ * area written behind the records.
  */
 static int
-missing(        int *b,
-                int n,
-                int N   )
+strat_fill(     wnode *t,
+                strat_node *v,
+                int *idx,
+                long *soff      )
 {
-        int *t = calloc(N + 1, sizeof(int)), k;
-        for(k = 0; k < n; k++) {
-                t[b[k]] = 1;
-                t[op(b[k])] = 1;
+        if(t == NULL)
+                return -1;
+        int i = (*idx)++, j;
+        v[i].len = t->len;
+        v[i].soff = *soff;
+        *soff += 2 * t->len;
+        for(j = 0; j < 3; j++) {
+                v[i].size[j] = t->size[j];
+                v[i].coin[j] = t->coin[j];
         }
-        for(k = 1; k <= N; k++)
-                if(!t[k]){
-                        free(t);
-                        return k;
-                }
-        printf("Error.\n");
-        exit(0);
+        for(j = 0; j < 3; j++)
+                v[i].child[j] = strat_fill(t->child[j], v, idx, soff);
+        return i;
 }
-                        
 
-/* Compare function for sorting heavy-codes
- */
-static int 
-compare(        const void *a, 
-                const void *b   )
+static void
+strat_sides(    wnode *t,
+                FILE *f )
 {
-        int a1 = *(int*)a, b1 = *(int*)b;
-        return (a1 < b1 ? -1 : (a1 == b1 ? 0 : 1));
+        int j;
+        if(t == NULL)
+                return;
+        fwrite(t->s1, sizeof(int), t->len, f);
+        fwrite(t->s2, sizeof(int), t->len, f);
+        for(j = 0; j < 3; j++)
+                strat_sides(t->child[j], f);
 }
 
+static FILE*
+strat_create(   char *file,
+                int type,
+                int n_coins,
+                int k,
+                int count       )
+{
+        FILE *f = fopen(file, "wb");
+        if(f == NULL) {
+                printf("Cannot write %s.\n", file);
+                exit(1);
+        }
+        strat_hdr h = { STRAT_MAGIC, type, n_coins, k, count };
+        fwrite(&h, sizeof(h), 1, f);
+        return f;
+}
 
-        
-/* Algorithmic solution for the saturated case n = (3^k-1)/2-1
- * Works by extending the previous (k - 1) solution b as follows:
- * 1. Extend each code in b with base-3 digit 0 
- * 2. Extend each code in b with base-3 digit 1
- * 3. Extend each code in b with base-3 digit 2
- * 4. Add code (2, 0, 0,..., 0)
- * 5. Find missing number m in b, add code (0, m) and (1, op(m))
- * Total number = 3*size(b)+3
- */
 static void
-getbase(        int k,          // number of weighings
-                int *b  )       // array for heavy-codes (must be allocated)
+strat_write_dynamic(    char *file,
+                        wnode *t,
+                        int n_coins     )
+{
+        int count = strat_count(t), idx = 0;
+        long soff = 0;
+        strat_node *v = calloc(count, sizeof(strat_node));
+        strat_fill(t, v, &idx, &soff);
+        FILE *f = strat_create(file, STRAT_DYNAMIC, n_coins,
+                                t ? t->depth : 0, count);
+        fwrite(v, sizeof(strat_node), count, f);
+        strat_sides(t, f);
+        fclose(f);
+        free(v);
+}
+
+static void
+strat_write_static(     char *file,
+                        int k,
+                        int n_coins,
+                        int *hcode      )
+{
+        FILE *f = strat_create(file, STRAT_STATIC, n_coins, k, n_coins);
+        fwrite(hcode, sizeof(int), n_coins, f);
+        fclose(f);
+}
+
+
+/* Strategy cache (-S dir).  The front-end re-requests a small set of
+ * popular n, so solved strategies are kept as ordinary -o format
+ * files named coin-<n>-<s|d>[-variant][-moves].strat in the cache
+ * directory - the name carries everything that shapes the tree, so a
+ * -c moves run never serves (or poisons) a canonical entry.  A hit is
+ * mmap()d read-only and served without running the solver; the page
+ * cache shares one copy across processes.  Population goes through a
+ * temporary name and rename(), so concurrent solvers never expose a
+ * torn file, and happens after -V verification when requested.
+ */
+static char *cache_dir = NULL;          // -S: strategy cache directory
+
+static void
+cache_path(     char *buf,
+                size_t size,
+                int n_coins,
+                int stat        )
 {
-        if(k == 2) {
-                b[0] = 1;
-                b[1] = 8;
-                b[2] = 3;
+        if(cache_dir == NULL) {
+                buf[0] = 0;
                 return;
         }
-        getbase(k - 1, b);
-        int c = ipow(3, k - 1),
-                n =  c / 2 - 1, j, 
-                m = missing(b, n, c - 1);
-        for(j = 0; j < n; j++) {
-                b[n + j] = b[j] + c;
-                b[2 * n + j] = b[j] + 2 * c;
+        static const char *vtag[] = { "", "-light", "-exist" };
+        snprintf(buf, size, "%s/coin-%d-%c%s%s.strat", cache_dir, n_coins,
+                stat ? 's' : 'd', vtag[variant],
+                sel_cost != NULL ? "-moves" : "");
+}
+
+static void
+cache_store_dynamic(    wnode *t,
+                        int n_coins     )
+{
+        char path[256], tmp[272];
+        cache_path(path, sizeof(path), n_coins, 0);
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+        strat_write_dynamic(tmp, t, n_coins);
+        rename(tmp, path);
+}
+
+static void
+cache_store_static(     int k,
+                        int n_coins,
+                        int *hcode      )
+{
+        char path[256], tmp[272];
+        cache_path(path, sizeof(path), n_coins, 1);
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+        strat_write_static(tmp, k, n_coins, hcode);
+        rename(tmp, path);
+}
+
+
+/* Self-verification (-V): simulate every scenario of the active
+ * variant (each coin too heavy, each coin too light, no false coin,
+ * as far as the variant allows them) against the solved
+ * strategy and confirm that every one of them reaches a leaf carrying
+ * exactly its own answer.  The scenarios are split into one chunk per
+ * solver thread; each chunk is pushed down the stored tree with the
+ * same side-table classification weigh() uses, so a million scenarios
+ * verify in seconds.
+ */
+static int verify = 0;                  // -V: verify the strategy
+
+static long
+verify_walk(    wnode *t,
+                coin_set c,             // scenarios reaching this node
+                int nc,
+                int *err        )
+{
+        coin_set cr[3];
+        arena_state as = arena_save();
+        long ok = 0;
+        int j;
+
+        weigh(c, t->s1, t->s2, t->len, nc, cr);
+        for(j = 0; j < 3; j++) {
+                if(cr[j].n == 0 && t->child[j] != NULL)
+                        continue;       // no scenario of this chunk here
+                if(t->child[j] != NULL)
+                        ok += verify_walk(t->child[j], cr[j], nc, err);
+                else if(cr[j].n > 1 ||
+                        (cr[j].n == 1 && cr[j].first != t->coin[j]))
+                        *err = 1;       // ambiguous leaf or wrong answer
+                else
+                        ok += cr[j].n;  // scenario solved correctly
+        }
+        for(j = 0; j < 3; j++)
+                cs_drop(&cr[j]);
+        arena_restore(as);
+        return ok;
+}
+
+typedef struct{
+        wnode *t;
+        int nc;
+        int lo, len;                    // chunk of the scenario sequence
+        long ok;
+        int err;
+} verify_task;
+
+static void*
+verify_worker(  void *arg       )
+{
+        verify_task *v = arg;
+        coin_set c;
+        int j;
+
+        arena_init();
+        bzero(&c, sizeof(c));
+        c.kind = CS_MEM;
+        c.n = v->len;
+        c.p = arena_alloc(v->len * sizeof(int));
+        for(j = 0; j < v->len; j++)     // the variant's initial set
+                c.p[j] = init_pos(v->lo + j, v->nc);
+        c.first = c.p[0];
+        v->ok = verify_walk(v->t, c, v->nc, &v->err);
+        arena_free();
+        free(side);
+        side = NULL;
+        side_size = 0;
+        STATS_FLUSH();
+        return NULL;
+}
+
+static void
+verify_tree(    wnode *t,
+                int nc  )
+{
+        int total = init_count(nc), nt = n_jobs, j, err = 0;
+        long ok = 0;
+
+        if(nt > total)
+                nt = total;
+        pthread_t th[nt];
+        verify_task task[nt];
+        for(j = 0; j < nt; j++) {       // one contiguous chunk per thread
+                task[j].t = t;
+                task[j].nc = nc;
+                task[j].lo = (long)total * j / nt;
+                task[j].len = (long)total * (j + 1) / nt - task[j].lo;
+                task[j].ok = 0;
+                task[j].err = 0;
+                pthread_create(&th[j], NULL, verify_worker, &task[j]);
+        }
+        for(j = 0; j < nt; j++) {
+                pthread_join(th[j], NULL);
+                ok += task[j].ok;
+                err |= task[j].err;
+        }
+        if(err || ok != total) {
+                printf("Verification FAILED: %ld of %d scenarios solved.\n",
+                        ok, total);
+                exit(1);
+        }
+        printf("Verified %d scenarios.\n", total);
+}
+
+static int
+weigh_sequential(       coin_set c,             // coins
+                        int nc  )               // number of coins
+{
+        wnode *t = build_tree(c, nc, NULL);
+        if(verbose) {
+                if(out_fmt == FMT_JSON)
+                        print_tree_json(t, nc);
+                else {
+                        print_tree(t);
+                        out_flush();
+                }
+        }
+        if(verify)
+                verify_tree(t, nc);
+        if(out_file)
+                strat_write_dynamic(out_file, t, nc);
+        if(cache_dir)
+                cache_store_dynamic(t, nc);
+        int r = t ? t->depth : 0;
+        free_tree(t);
+        return r;
+}
+
+/* Static weigh strategy 
+* See http://paulbourke.net/fun/counterfeit.html for the terms used
+* The saturated case (number of coins) = (3^(number of weighings) - 1) / 2 - 1
+* is determined algorithmically, the other cases are solved by extending
+* the closest saturated case.
+*/
+
+static inline int
+ipow(   int x,
+        int n   )
+{
+        int r = 1;
+        while(n--)
+                r *= x;
+        return r;
+}
+
+/* Base-3 digit work is the hot spot of the static solver: op() and
+ * mcomplement() sit in the innermost loops of add() and the sieve and
+ * spend most of their time in divisions by 3.  Codes are therefore
+ * processed in groups of 5 trits (3^5 = 243) through tables set up
+ * once by trit_init(): op3[] complements a whole group, mc3[][] merges
+ * a group of m with a group of hc (or flags the collision), and pow3[]
+ * replaces the division loop in digit() by a single division.
+ */
+#define TRIT_GROUP 243                  // 3^5, 5 trits per table index
+#define MC_FAIL 0xffff                  // collision marker in mc3
+
+static int pow3[20];                    // 3^0 ... 3^19 (3^20 > INT_MAX)
+static unsigned short op3[TRIT_GROUP];
+static unsigned short mc3[TRIT_GROUP][TRIT_GROUP];
+
+static void
+trit_init()
+{
+        int g, h, j;
+        pow3[0] = 1;
+        for(j = 1; j < 20; j++)
+                pow3[j] = 3 * pow3[j - 1];
+        for(g = 0; g < TRIT_GROUP; g++) {
+                int x = g, c, s = 0;
+                for(c = 1; x; x /= 3, c *= 3) {
+                        switch(x % 3){
+                        case 1:
+                                s += 2 * c;
+                                break;
+                        case 2:
+                                s += c;
+                                break;
+                        }
+                }
+                op3[g] = s;
+        }
+        for(g = 0; g < TRIT_GROUP; g++) {
+                for(h = 0; h < TRIT_GROUP; h++) {
+                        int m = g, hc = h, c, s = 0;
+                        for(c = 1; c < TRIT_GROUP; c *= 3, m /= 3, hc /= 3) {
+                                int r = m % 3, rh = hc % 3;
+                                if(r == 0)
+                                        s += rh * c;
+                                else if(rh != 0) {      // collision
+                                        s = MC_FAIL;
+                                        break;
+                                } else
+                                        s += (r == 1 ? 2 : 1) * c;
+                        }
+                        mc3[g][h] = s;
+                }
+        }
+}
+
+/* Base 3 complement of x :  turn 1s into 2s and vice versa
+ */
+static inline int
+op(     int x   )
+{
+        int c = 1, s = 0;
+        STAT_ADD(op_calls, 1);
+        for(; x; x /= TRIT_GROUP, c *= TRIT_GROUP)
+                s += op3[x % TRIT_GROUP] * c;
+        return s;
+}
+
+/* Base 3 digit of x at position n (n = 0: rightmost)
+ */
+static inline int
+digit(  int x,
+        int n   )
+{
+        return x / pow3[n] % 3;
+}
+
+/* Occupancy sieve over the code space 1,..., 3^k - 1.
+ * Entry v is set iff v or op(v) is taken by a heavy-code, so the
+ * membership scan of the former isfree() becomes a single load.
+ * code_free tracks the smallest unused value; add() starts its
+ * candidate search there instead of at 1, and values released when a
+ * code is modified pull the cursor back, so the search order stays
+ * exactly that of the old linear scan.
+ */
+static char *code_used = NULL;
+static int code_used_size = 0;
+static int code_free = 1;               // smallest value not in use
+
+static void
+code_mark(      int v   )
+{
+        code_used[v] = code_used[op(v)] = 1;
+        while(code_free < code_used_size && code_used[code_free])
+                code_free++;
+}
+
+static void
+code_unmark(    int v   )
+{
+        int o = op(v);
+        code_used[v] = code_used[o] = 0;
+        if(v < code_free)
+                code_free = v;
+        if(o < code_free)
+                code_free = o;
+}
+
+static void
+sieve_init(     int *hc,                // heavy-codes so far
+                int nc,                 // their number
+                int k   )               // number of weighings
+{
+        int j, n = ipow(3, k);
+        free(code_used);
+        code_used = calloc(n, 1);
+        code_used_size = n;
+        code_free = 1;
+        for(j = 0; j < nc; j++)
+                code_mark(hc[j]);
+}
+
+/* Check if t or op(t) is already taken by a heavy-code.
+ */
+static inline int
+isfree(         int t   )
+{
+        STAT_ADD(free_probes, 1);
+        return !code_used[t];
+}
+
+
+/* The heavy-code array is kept sorted at all times -- the candidate
+ * search in add() depends on visiting codes in ascending order -- but
+ * instead of a qsort() per insertion, positions are found by binary
+ * search and opened/closed with one memmove.
+ */
+static void
+insert_sorted(  int *b,
+                int n,                  // current size, capacity n + 1
+                int v   )
+{
+        int lo = 0, hi = n;
+        while(lo < hi) {
+                int mid = (lo + hi) / 2;
+                if(b[mid] < v)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        memmove(b + lo + 1, b + lo, (n - lo) * sizeof(int));
+        b[lo] = v;
+}
+
+static void
+remove_sorted(  int *b,
+                int n,                  // current size
+                int v   )
+{
+        int lo = 0, hi = n;
+        while(lo < hi) {
+                int mid = (lo + hi) / 2;
+                if(b[mid] < v)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        memmove(b + lo, b + lo + 1, (n - lo - 1) * sizeof(int));
+}
+
+
+        
+/* Algorithmic solution for the saturated case n = (3^k-1)/2-1.
+ * The classic construction extends the (k - 1) solution b by
+ * 1. Extending each code in b with base-3 digit 0, 1 and 2
+ * 2. Adding code (2, 0, 0,..., 0)
+ * 3. Finding a number m missing in b, adding (0, m) and (1, op(m))
+ * for a total of 3*size(b)+3 codes.  Unrolling this recursion gives a
+ * closed form: the missing number at level j is always (3^(j-1)+1)/2,
+ * so a code belongs to the level-k set iff its lowest j base-3 digits
+ * equal one of the three codes introduced at some level j <= k --
+ * 1, 3, 8 at level 2 and (3^(j-1)+1)/2, 2*3^(j-1)-2, 2*3^(j-1) above.
+ * Scanning 1,..., 3^k - 1 against this test emits the heavy codes
+ * directly in sorted order, in one linear pass and with no
+ * intermediate tables, re-sorting or per-level rebuilds.
+ */
+static void
+getbase(        int k,          // number of weighings
+                int *b  )       // array for heavy-codes (must be allocated)
+{
+        int n = 0, v, N = ipow(3, k);
+
+        for(v = 1; v < N; v++) {
+                int j, pj;
+                for(j = 2, pj = 9; j <= k; j++, pj *= 3) {
+                        int r = v % pj, c = pj / 3;
+                        if(j == 2 ? r == 1 || r == 3 || r == 8
+                                  : r == (c + 1) / 2 || r == 2 * c - 2
+                                        || r == 2 * c) {
+                                b[n++] = v;
+                                break;
+                        }
+                }
         }
-        b[2 * n + j] = 2 * c;
-        b[2 * n + j + 1] = m;
-        b[2 * n + j + 2] = c + op(m);
-        qsort(b, ipow(3, k) / 2 - 1, sizeof(int), compare);
 }
 
 static void
@@ -724,43 +2510,94 @@ print_static(   int k,
                 int nc,
                 int *hcode      )
 {
-        int j, i, *s1 = NULL, *s2 = NULL, n1, n2;
-        for(j = 0; j < nc; j++)         // print coins
-                logd("%2d ", j + 1);
-        logd("\n\n+\n");
+        int j, i, n1, n2;
+        if(!verbose)                    // -q: skip the print work entirely
+                return;
+        int *s1 = arena_alloc(nc * sizeof(int));        // at most nc coins per side
+        int *s2 = arena_alloc(nc * sizeof(int));
+        char *dig = arena_alloc(nc * k);    // decompose each code only once
+        for(j = 0; j < nc; j++) {
+                int x = hcode[j];
+                for(i = 0; i < k; i++, x /= 3)
+                        dig[j * k + i] = x % 3;
+        }
+        for(j = 0; j < nc; j++) {       // print coins
+                out_int(j + 1, 2);
+                out_char(' ');
+        }
+        out_str("\n\n+\n");
         for(i = k - 1; i >= 0; i--){    // print hcodes
-                for(j = 0; j < nc; j++)
-                        logd("%2d ", digit(hcode[j], i));
-                logd("\n");
+                for(j = 0; j < nc; j++) {
+                        out_int(dig[j * k + i], 2);
+                        out_char(' ');
+                }
+                out_char('\n');
         }
-        logd("-\n");
+        out_str("-\n");
         for(i = k - 1; i >= 0; i--){    // print lcodes
-                for(j = 0; j < nc; j++)
-                        logd("%2d ", digit(op(hcode[j]), i));
-                logd("\n");
+                for(j = 0; j < nc; j++) {
+                        out_int((3 - dig[j * k + i]) % 3, 2);
+                        out_char(' ');
+                }
+                out_char('\n');
         }
-        logd("\n");
+        out_char('\n');
         for(i = k - 1; i >= 0; i--){    // print equations/ weighings
                 n1 = n2 = 0;
                 for(j = 0; j < nc; j++) {
-                        switch(digit(hcode[j], i)){
+                        switch(dig[j * k + i]){
                         case 1:
-                                s1 = add_int(j, s1, ++n1);
+                                s1[n1++] = j;
                                 break;
                         case 2:
-                                s2 = add_int(j, s2, ++n2);
+                                s2[n2++] = j;
                                 break;
                         }
                 }
                 if(n1 == 0 || n1 != n2) {
+                        out_flush();
                         printf("Error print_static.\n");
                         exit(1);
                 }
                 print_vectors(s1, s2, n1);
-                logd("\n");
+                out_char('\n');
+        }
+        out_flush();
+}
+
+/* Static code tables as CSV (-f csv): one row per coin with its heavy
+ * code, its light code and the k base-3 code digits, most significant
+ * first.  Digit 1 puts the coin on the left arm of that weighing,
+ * digit 2 on the right, 0 leaves it off the scale, so the weighing
+ * table needs no separate dump.
+ */
+static void
+print_static_csv(       int k,
+                        int nc,
+                        int *hcode      )
+{
+        int i, j;
+        if(!verbose)                    // -q: skip the print work entirely
+                return;
+        out_str("coin,hcode,lcode");
+        for(i = k - 1; i >= 0; i--) {
+                out_str(",d");
+                out_int(i, 0);
+        }
+        out_char('\n');
+        for(j = 0; j < nc; j++) {
+                out_int(j + 1, 0);
+                out_char(',');
+                out_int(hcode[j], 0);
+                out_char(',');
+                out_int(op(hcode[j]), 0);
+                for(i = k - 1; i >= 0; i--) {
+                        out_char(',');
+                        out_int(digit(hcode[j], i), 0);
+                }
+                out_char('\n');
         }
-        free(s1);
-        free(s2);
+        out_flush();
 }
 
 /* Given a number m, check, if hc has zero-(base-3)-digits at positions
@@ -771,24 +2608,154 @@ print_static(   int k,
  *         hc = 9 = base3(1 0 0)
  *      return 16 = base3(1 2 1)
  */
-static int
-mcomplement(    int m,                  // copy hc-digits != 0, set others 
-                int hc,                 // to complement of m, fail if both digits != 0
-                int k           )       // number of digits to check
-{
-        int j, c = 1, s = 0;
-        for(j = 0; j < k; j++, m /= 3, hc /= 3, c *= 3) {
-                int r = m % 3, rh = hc % 3;
-                if(r == 0){
-                        s += rh * c;
-                        continue;
-                } else if(rh != 0) // failure
+static inline int
+mcomplement(    int m,                  // copy hc-digits != 0, set others
+                int hc          )       // to complement of m, fail if both digits != 0
+{
+        int c = 1, s = 0;
+        for(; m || hc; m /= TRIT_GROUP, hc /= TRIT_GROUP, c *= TRIT_GROUP) {
+                int t = mc3[m % TRIT_GROUP][hc % TRIT_GROUP];
+                if(t == MC_FAIL)
                         return 0;
-                s += (r == 1 ? 2 : 1) * c;
+                s += t * c;
         }
         return s;
 }
 
+/* Parallel candidate search for add() (-j N).  Nearly all the work of
+ * one add() is the inner scan trying mcomplement() of one candidate m
+ * against every existing code j - the outer loop rarely advances past
+ * a handful of candidates - so that scan is the dimension that gets
+ * parallelized.  It is read-only over the heavy-code table and the
+ * sieve: pool threads pull chunks of the j range from a shared cursor
+ * and test them without locks; the exclusive section is only the
+ * final table modification, done by the caller after all threads
+ * finished.  A thread's chunks ascend, so its first hit is its
+ * smallest, and it stops as soon as its next chunk lies above the
+ * smallest hit found anywhere.  Taking the globally smallest winning
+ * j afterwards gives exactly the code the sequential scan would have
+ * chosen, so -j does not change the resulting strategy.  The pool
+ * threads persist across add() calls - one candidate scan is far too
+ * short-lived to pay a thread spawn - and since one scan is also far
+ * too short-lived to pay a condvar round trip, they spin briefly on
+ * the generation counter before sleeping: scans arrive back to back,
+ * so the spin almost always catches the next one.  The calling thread
+ * scans alongside the pool instead of blocking.
+ */
+#define ADD_CHUNK 512                   // codes claimed at a time
+#define ADD_PAR_MIN 16384               // minimum table size worth threads
+#define ADD_SPIN (1 << 10)              // pause iterations before yielding
+#define ADD_YIELD 64                    // yields before sleeping
+
+#if defined(__x86_64__)
+#define cpu_pause()     _mm_pause()
+#else
+#define cpu_pause()
+#endif
+
+typedef struct{
+        int j, t;                       // smallest hit of this thread
+} add_task;
+
+static struct{
+        int next;                       // next unclaimed code index
+        int limit;                      // number of codes
+        int best;                       // smallest winning j so far
+        pthread_mutex_t mtx;
+} add_sh = { 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static struct{
+        int nt;                         // pool threads, 0 - not started
+        int gen;                        // job generation
+        int done;                       // threads finished with it
+        int *hc;                        // heavy codes of the current job
+        int m;                          // candidate being tried
+        add_task *task;                 // slots: nt threads + the caller
+        pthread_mutex_t mtx;
+        pthread_cond_t go;
+} add_pool = { 0, 0, 0, NULL, 0, NULL, PTHREAD_MUTEX_INITIALIZER,
+                PTHREAD_COND_INITIALIZER };
+
+static void
+add_scan(       add_task *a     )
+{
+        int lo, hi, j;
+
+        a->j = -1;
+        for(;;) {
+                /* claim the next chunk; a stale best only costs one
+                 * needless chunk scan, never a wrong result */
+                lo = __atomic_fetch_add(&add_sh.next, ADD_CHUNK,
+                        __ATOMIC_RELAXED);
+                if(lo >= add_sh.limit ||
+                    lo > __atomic_load_n(&add_sh.best, __ATOMIC_RELAXED))
+                        return;
+                hi = lo + ADD_CHUNK < add_sh.limit ?
+                        lo + ADD_CHUNK : add_sh.limit;
+                for(j = lo; j < hi; j++) {
+                        int t = mcomplement(add_pool.m, add_pool.hc[j]);
+                        if(t && isfree(t)) {
+                                a->j = j;
+                                a->t = t;
+                                pthread_mutex_lock(&add_sh.mtx);
+                                if(j < add_sh.best)
+                                        add_sh.best = j;
+                                pthread_mutex_unlock(&add_sh.mtx);
+                                return;
+                        }
+                }
+        }
+}
+
+static void*
+add_pool_worker(        void *arg       )
+{
+        add_task *a = arg;
+        int gen = 0, i;
+
+        for(;;) {
+                /* pause-spin, then yield, then sleep: scans usually
+                 * arrive back to back, but on an oversubscribed box
+                 * spinning would starve the threads doing the work */
+                for(i = 0; i < ADD_SPIN + ADD_YIELD; i++) {
+                        if(__atomic_load_n(&add_pool.gen,
+                                        __ATOMIC_ACQUIRE) != gen)
+                                break;
+                        if(i < ADD_SPIN)
+                                cpu_pause();
+                        else
+                                sched_yield();
+                }
+                if(i == ADD_SPIN + ADD_YIELD) {         // gap between adds
+                        pthread_mutex_lock(&add_pool.mtx);
+                        while(add_pool.gen == gen)
+                                pthread_cond_wait(&add_pool.go,
+                                        &add_pool.mtx);
+                        pthread_mutex_unlock(&add_pool.mtx);
+                }
+                gen = __atomic_load_n(&add_pool.gen, __ATOMIC_ACQUIRE);
+                add_scan(a);
+                STATS_FLUSH();
+                __atomic_add_fetch(&add_pool.done, 1, __ATOMIC_RELEASE);
+        }
+        return NULL;
+}
+
+static void
+add_pool_start()
+{
+        pthread_t th;
+        int i;
+
+        add_pool.nt = n_jobs - 1;       // the caller scans as well
+        add_pool.task = calloc(add_pool.nt + 1, sizeof(add_task));
+        for(i = 0; i < add_pool.nt; i++) {
+                pthread_create(&th, NULL, add_pool_worker,
+                        &add_pool.task[i]);
+                pthread_detach(th);     // pool lives until process exit
+        }
+}
+
 /* Find a suitable candidate and add it to the list of heavy codes hc
  */
 static void
@@ -798,16 +2765,61 @@ add(            int *hc,                // heavy codes, must be allocated
 {
         int n = ipow(3, k) - 1;         // possible values 1, ... n
         int j, m;
-        
-        for(m = 1; m <= n; m++) {       // all possible values
-                if( !isfree(m, hc, nc)) // value is in use
+
+        if(n_jobs > 1 && nc >= ADD_PAR_MIN) {
+                int i, w;
+                if(add_pool.nt == 0)
+                        add_pool_start();
+                for(m = code_free; m <= n; m++) {
+                        if( !isfree(m))
+                                continue;
+                        add_sh.next = 0;
+                        add_sh.limit = nc;
+                        add_sh.best = INT_MAX;
+                        add_pool.hc = hc;
+                        add_pool.m = m;
+                        add_pool.done = 0;
+                        __atomic_add_fetch(&add_pool.gen, 1,
+                                __ATOMIC_RELEASE);
+                        pthread_mutex_lock(&add_pool.mtx);
+                        pthread_cond_broadcast(&add_pool.go);
+                        pthread_mutex_unlock(&add_pool.mtx);
+                        add_scan(&add_pool.task[add_pool.nt]);
+                        for(i = 0; __atomic_load_n(&add_pool.done,
+                                        __ATOMIC_ACQUIRE) < add_pool.nt; i++)
+                                if(i < ADD_SPIN)
+                                        cpu_pause();
+                                else
+                                        sched_yield();
+                        for(i = 0, w = -1; i <= add_pool.nt; i++) {
+                                add_task *a = &add_pool.task[i];
+                                if(a->j >= 0 && (w < 0 ||
+                                                a->j < add_pool.task[w].j))
+                                        w = i;
+                        }
+                        if(w >= 0) {
+                                add_task *a = &add_pool.task[w];
+                                code_unmark(hc[a->j]);
+                                remove_sorted(hc, nc, hc[a->j]);
+                                insert_sorted(hc, nc - 1, a->t);
+                                code_mark(a->t);
+                                insert_sorted(hc, nc, m);
+                                code_mark(m);
+                                return;
+                        }
+                }
+        } else for(m = code_free; m <= n; m++) {        // all possible values
+                if( !isfree(m))         // value is in use
                         continue;
                 for(j = 0; j < nc; j++) {
-                        int t = mcomplement(m, hc[j], k); // try to modify another member 
-                        if(t && isfree(t, hc, nc)) {      // success
-                                hc[j] = t;                // modify the found other member
-                                hc[nc] = m;               // add m
-                                qsort(hc, nc + 1, sizeof(int), compare);
+                        int t = mcomplement(m, hc[j]); // try to modify another member
+                        if(t && isfree(t)) {              // success
+                                code_unmark(hc[j]);
+                                remove_sorted(hc, nc, hc[j]);
+                                insert_sorted(hc, nc - 1, t); // modify the found other member
+                                code_mark(t);
+                                insert_sorted(hc, nc, m);     // add m
+                                code_mark(m);
                                 return;
                         }
                 }
@@ -817,10 +2829,133 @@ add(            int *hc,                // heavy codes, must be allocated
 }
 
 
+/* A static strategy is correct iff every code is in 1,..., 3^k - 1,
+ * no code or its complement occurs twice (unique outcomes for all
+ * 2n + 1 scenarios) and every weighing puts the same number of coins
+ * on both arms of the scale.
+ */
+static void
+verify_static(  int k,
+                int nc,
+                int *hcode      )
+{
+        int n = ipow(3, k), i, j, err = 0;
+        char *used = calloc(n, 1);
+        int *ndig = calloc(3 * k, sizeof(int));
+
+        for(j = 0; j < nc; j++) {
+                int v = hcode[j], x;
+                if(v < 1 || v >= n || used[v] || used[op(v)]) {
+                        err = 1;
+                        break;
+                }
+                used[v] = used[op(v)] = 1;
+                for(i = 0, x = v; i < k; i++, x /= 3)
+                        ndig[3 * i + x % 3]++;
+        }
+        for(i = 0; i < k && !err; i++)  // balanced, non-empty weighings
+                if(ndig[3 * i + 1] == 0 || ndig[3 * i + 1] != ndig[3 * i + 2])
+                        err = 1;
+        free(used);
+        free(ndig);
+        if(err) {
+                printf("Verification FAILED.\n");
+                exit(1);
+        }
+        printf("Verified %d scenarios.\n", 2 * nc + 1);
+}
+
+
 /* The static weighstrategy for nc coins first finds the closest
  * base solution with (number of coins) <= n_coins, then adds one coin
  * after another to this solution until n_coins is reached.
+ * The heavy-code table and the sieve persist between calls: a later
+ * job with the same number of weighings (batch mode -B) continues
+ * add()ing where the previous one stopped instead of replaying the
+ * whole extension from the base solution.
+ */
+static int *hc_tab = NULL;              // heavy-code table
+static int hc_n = 0;                    // coins covered by hc_tab
+static int hc_k = 0;                    // weighings of the current table
+
+static void
+static_clear()
+{
+        free(hc_tab);
+        hc_tab = NULL;
+        hc_n = hc_k = 0;
+        free(code_used);
+        code_used = NULL;
+        code_used_size = 0;
+        code_free = 1;
+}
+
+/* Checkpointing for long static solves (-C file).  A snapshot is an
+ * ordinary STRAT_STATIC strategy file for the coins covered so far,
+ * so it also works with lookup mode (-L) as is.  Snapshots go to a
+ * temporary name and are rename()d into place, so a kill at any
+ * moment leaves the last complete one.  The occupancy sieve is not
+ * stored; sieve_init() rebuilds it from the codes on resume, which
+ * keeps the file at one int per coin.  Since add() may modify earlier
+ * codes, the whole table is rewritten each time -- at one int per
+ * coin that is far cheaper than a single add() at these sizes.
+ * A snapshot resumes any job with the same number of weighings and at
+ * least as many coins, so one long run serves all smaller and larger n.
  */
+static char *ckpt_file = NULL;          // -C: checkpoint file
+static time_t ckpt_last = 0;
+
+#define CKPT_INTERVAL 60                // seconds between snapshots
+
+static void
+ckpt_write(     int k   )
+{
+        char tmp[256];
+        if(ckpt_file == NULL)
+                return;
+        snprintf(tmp, sizeof(tmp), "%s.tmp", ckpt_file);
+        FILE *f = fopen(tmp, "wb");
+        if(f == NULL) {
+                printf("Cannot write %s.\n", tmp);
+                exit(1);
+        }
+        strat_hdr h = { STRAT_MAGIC, STRAT_STATIC, hc_n, k, hc_n };
+        fwrite(&h, sizeof(h), 1, f);
+        fwrite(hc_tab, sizeof(int), hc_n, f);
+        fclose(f);
+        rename(tmp, ckpt_file);
+        ckpt_last = time(NULL);
+}
+
+static int
+ckpt_load(      int k,                  // weighings of this job
+                int n,                  // base solution size
+                int n_coins     )
+{
+        FILE *f = fopen(ckpt_file, "rb");
+        strat_hdr h;
+
+        if(f == NULL)
+                return 0;
+        if(fread(&h, sizeof(h), 1, f) != 1 || h.magic != STRAT_MAGIC
+                        || h.type != STRAT_STATIC || h.k != k
+                        || h.count < n || h.count > n_coins) {
+                fclose(f);
+                return 0;               // not usable for this job
+        }
+        hc_tab = realloc(hc_tab, n_coins * sizeof(int));
+        if(fread(hc_tab, sizeof(int), h.count, f) != (size_t)h.count) {
+                fclose(f);
+                return 0;
+        }
+        fclose(f);
+        sieve_init(hc_tab, h.count, k);
+        hc_n = h.count;
+        hc_k = k;
+        logd("Resumed %d coins from %s.\n", hc_n, ckpt_file);
+        return 1;
+}
+
 static int
 weigh_static(   int n_coins  )
 {
@@ -832,53 +2967,904 @@ weigh_static(   int n_coins  )
                 if(n_base >= n_coins)
                         break;
         }
-        
-        int *hcode = calloc(n_coins, sizeof(int));      // heavy-codes
-        
-        getbase(n == n_coins ? k : k - 1, hcode);
 
-        while(n < n_coins) {
-                add(hcode, k, n++);
+        /* reuse the table only if it has the same number of weighings,
+         * already covers the base solution for this job and does not
+         * exceed the requested size -- then continuing add() gives the
+         * same result as solving from scratch */
+        if(hc_k != k || hc_n < n || hc_n > n_coins) {
+                if(ckpt_file == NULL || !ckpt_load(k, n, n_coins)) {
+                        hc_tab = realloc(hc_tab, n_coins * sizeof(int));
+                        getbase(n == n_coins ? k : k - 1, hc_tab);
+                        sieve_init(hc_tab, n, k);
+                        hc_n = n;
+                        hc_k = k;
+                }
+        } else if(hc_n < n_coins)                       // continue the previous job
+                hc_tab = realloc(hc_tab, n_coins * sizeof(int));
+
+        while(hc_n < n_coins) {
+                add(hc_tab, k, hc_n++);
+                if(ckpt_file != NULL &&
+                                time(NULL) - ckpt_last >= CKPT_INTERVAL)
+                        ckpt_write(k);
         }
-        
-        print_static(k, n_coins, hcode);
+        if(ckpt_file != NULL && hc_n > 0)               // final snapshot
+                ckpt_write(k);
+
+        if(out_fmt == FMT_CSV)
+                print_static_csv(k, n_coins, hc_tab);
+        else
+                print_static(k, n_coins, hc_tab);
+        if(verify)
+                verify_static(k, n_coins, hc_tab);
+        if(out_file)
+                strat_write_static(out_file, k, n_coins, hc_tab);
+        if(cache_dir)
+                cache_store_static(k, n_coins, hc_tab);
         return k;
 }
 
 
-static void
-usage()
-{
-        fprintf(stderr, "Usage:\n coin [-s (static)] [-n number_of_coins]\
-                [-q (quiet)]\n");
-        exit(0);
-}
-
+#ifndef COIN_BENCH
+
+/* Lookup mode (-L file -r results): answer a result sequence from an
+ * exported strategy without re-solving.  The file is mapped read-only,
+ * so concurrent lookups across processes share the page cache.
+ * Results are one character per weighing: '+' or '1' left side heavy,
+ * '=' or '0' balanced, '-' or '2' left side light.
+ */
+static int
+rchar(  int c   )
+{
+        switch(c){
+        case '+': case '1':
+                return C_MORE;
+        case '=': case '0':
+                return C_EQUAL;
+        case '-': case '2':
+                return C_LESS;
+        }
+        printf("Invalid result character '%c'.\n", c);
+        exit(1);
+}
+
+static void
+strat_report(   int size,
+                int coin        )
+{
+        if(size == 0)
+                printf("Impossible result sequence.\n");
+        else if(coin == 0)
+                printf("No false coin.\n");
+        else if(coin > 0)
+                printf("Coin %d is heavy.\n", coin);
+        else
+                printf("Coin %d is light.\n", -coin);
+}
+
+static int
+strat_find(     int *b,         // sorted heavy-codes
+                int n,
+                int v   )       // index of v in b, -1 if absent
+{
+        int lo = 0, hi = n - 1;
+        while(lo <= hi) {
+                int mid = (lo + hi) / 2;
+                if(b[mid] < v)
+                        lo = mid + 1;
+                else if(b[mid] > v)
+                        hi = mid - 1;
+                else
+                        return mid;
+        }
+        return -1;
+}
+
+static void
+strat_lookup(   char *file,
+                char *results   )
+{
+        struct stat st;
+        int fd = open(file, O_RDONLY);
+        if(fd < 0 || fstat(fd, &st) < 0) {
+                printf("Cannot read %s.\n", file);
+                exit(1);
+        }
+        strat_hdr *h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(h == MAP_FAILED || st.st_size < (off_t)sizeof(strat_hdr)
+                        || h->magic != STRAT_MAGIC) {
+                printf("%s is not a strategy file.\n", file);
+                exit(1);
+        }
+        if(h->type == STRAT_STATIC) {
+                int *hc = (int*)(h + 1), t = 0, j;
+                if((int)strlen(results) != h->k) {
+                        printf("Need %d results for this strategy.\n", h->k);
+                        exit(1);
+                }
+                for(j = 0; j < h->k; j++)       // first result is the
+                        t += rchar(results[j]) * pow3[h->k - 1 - j];
+                                                // most significant digit
+                if(t == 0)
+                        printf("No false coin.\n");
+                else if((j = strat_find(hc, h->count, t)) >= 0)
+                        printf("Coin %d is heavy.\n", j + 1);
+                else if((j = strat_find(hc, h->count, op(t))) >= 0)
+                        printf("Coin %d is light.\n", j + 1);
+                else
+                        printf("Impossible result sequence.\n");
+        } else {
+                strat_node *v = (strat_node*)(h + 1);
+                int *sides = (int*)(v + h->count);
+                int i = 0;
+                char *p = results;
+                for(;;) {
+                        if(*p == 0) {   // not solved yet: show how to go on
+                                printf("Not solved, next weighing: ");
+                                print_vectors(sides + v[i].soff,
+                                        sides + v[i].soff + v[i].len,
+                                        v[i].len);
+                                out_char('\n');
+                                out_flush();
+                                break;
+                        }
+                        int r = rchar(*p++);
+                        if(v[i].child[r] >= 0) {
+                                i = v[i].child[r];
+                                continue;
+                        }
+                        strat_report(v[i].size[r], v[i].coin[r]);
+                        break;
+                }
+        }
+        munmap(h, st.st_size);
+        close(fd);
+}
+
+
+/* Cache hit path: map the stored strategy and serve it through the
+ * regular printers, verifier and exporter without running the solver.
+ * Dynamic strategies are rebuilt into wnodes whose side arrays point
+ * straight into the mapping, so the records are never copied; the
+ * mapping stays in place for the lifetime of the process.
+ */
+static strat_hdr*
+cache_map(      int n_coins,
+                int stat        )
+{
+        char path[256];
+        struct stat st;
+        strat_hdr *h;
+
+        if(cache_dir == NULL)
+                return NULL;
+        cache_path(path, sizeof(path), n_coins, stat);
+        int fd = open(path, O_RDONLY);
+        if(fd < 0)
+                return NULL;
+        if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(strat_hdr)) {
+                close(fd);
+                return NULL;
+        }
+        h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(h == MAP_FAILED)
+                return NULL;
+        if(h->magic != STRAT_MAGIC || h->n_coins != n_coins
+                        || h->type != (stat ? STRAT_STATIC : STRAT_DYNAMIC)) {
+                munmap(h, st.st_size);
+                return NULL;
+        }
+        return h;
+}
+
+static wnode*
+strat_tree(     strat_node *v,
+                int *sides,
+                int i   )               // record index, -1 when solved
+{
+        int j;
+
+        if(i < 0)
+                return NULL;
+        wnode *node = calloc(1, sizeof(wnode));
+        node->s1 = sides + v[i].soff;
+        node->s2 = sides + v[i].soff + v[i].len;
+        node->len = v[i].len;
+        for(j = 0; j < 3; j++) {
+                node->size[j] = v[i].size[j];
+                node->coin[j] = v[i].coin[j];
+                node->child[j] = strat_tree(v, sides, v[i].child[j]);
+        }
+        node->depth = 1 + max3(node->child[0] ? node->child[0]->depth : 0,
+                               node->child[1] ? node->child[1]->depth : 0,
+                               node->child[2] ? node->child[2]->depth : 0);
+        return node;
+}
+
+static int
+cache_serve(    strat_hdr *h,
+                int stat        )
+{
+        if(stat) {
+                int *hc = (int*)(h + 1);
+                if(out_fmt == FMT_CSV)
+                        print_static_csv(h->k, h->n_coins, hc);
+                else
+                        print_static(h->k, h->n_coins, hc);
+                if(verify)
+                        verify_static(h->k, h->n_coins, hc);
+                if(out_file)
+                        strat_write_static(out_file, h->k, h->n_coins, hc);
+                return h->k;
+        }
+        strat_node *v = (strat_node*)(h + 1);
+        wnode *t = h->count > 0 ? strat_tree(v, (int*)(v + h->count), 0)
+                                : NULL;
+        if(verbose) {
+                if(out_fmt == FMT_JSON)
+                        print_tree_json(t, h->n_coins);
+                else {
+                        print_tree(t);
+                        out_flush();
+                }
+        }
+        if(verify)
+                verify_tree(t, h->n_coins);
+        if(out_file)
+                strat_write_dynamic(out_file, t, h->n_coins);
+        return h->k;
+}
+
+
+/* Distributed solve (-P port on the coordinator, -W host:port on each
+ * worker).  After the coordinator has performed the first weighing
+ * itself the three result sets are independent subproblems, and each
+ * of them is fully described by its run-compressed possibility set,
+ * so a job message is a few dozen bytes regardless of n.  A worker
+ * solves its subtree with the normal builder (including -j threads)
+ * and streams back the same flat record image the -o exporter writes;
+ * the coordinator stitches the images under its root weighing with
+ * strat_tree() and continues like a local solve (print, -V, -o, -S).
+ * Jobs whose worker connection breaks go back into the queue, so a
+ * lost worker costs time, not the result.  All parties must run the
+ * same build on the same architecture, as with the mmap()d files.
+ */
+#define JOB_MAGIC 0x424f4a43            // "CJOB"
+
+typedef struct{
+        int magic;
+        int n_coins;
+        int variant;            // workers must play the same rules
+        int nrun;               // runs to follow, -1: no more work
+} dist_job;
+
+enum{ DJ_TODO = 0, DJ_ACTIVE, DJ_DONE };
+
+typedef struct{
+        coin_set c;             // subtree possibility set, run-compressed
+        strat_hdr *img;         // record image received from the worker
+        int state;
+} dist_sub;
+
+static dist_sub dsub[3];
+static int dist_nc;
+static pthread_mutex_t dist_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dist_cv = PTHREAD_COND_INITIALIZER;
+
+/* run-compress any set representation for the wire */
+static void
+cs_to_runs(     coin_set *c     )
+{
+        cs_iter it;
+        cs_run *runs;
+        int v = 0, nrun = 0;
+
+        if(c->kind == CS_RUN)
+                return;
+        runs = arena_alloc(c->n * sizeof(cs_run));
+        cs_begin(&it, c);
+        while(cs_next(&it, &v)) {
+                cs_run *r = nrun > 0 ? &runs[nrun - 1] : NULL;
+                if(r != NULL && r->n == 1 && (v == r->v + 1 || v == r->v - 1)) {
+                        r->s = v - r->v;
+                        r->n = 2;
+                } else if(r != NULL && v == r->v + r->s * r->n)
+                        r->n++;
+                else
+                        cs_setrun(&runs[nrun++], v, 1, 1);
+        }
+        cs_make(c, runs, nrun);
+}
+
+static FILE*
+sock_stream(    int fd  )
+{
+        FILE *f = fdopen(fd, "r+b");
+        if(f == NULL) {
+                printf("Cannot buffer the socket.\n");
+                exit(1);
+        }
+        return f;
+}
+
+static int
+send_job(       FILE *f,
+                coin_set *c     )
+{
+        dist_job job = { JOB_MAGIC, dist_nc, variant, c->nrun };
+        if(fwrite(&job, sizeof(job), 1, f) != 1 ||
+           fwrite(c->runs, sizeof(cs_run), c->nrun, f) != (size_t)c->nrun)
+                return -1;
+        return fflush(f) == 0 ? 0 : -1;
+}
+
+/* Read one dynamic record image; the side-area length is not in the
+ * header but follows from the node records, so read those first.
+ */
+static strat_hdr*
+recv_image(     FILE *f )
+{
+        strat_hdr h;
+        strat_hdr *img;
+        strat_node *v;
+        long ns = 0;
+        int j;
+
+        if(fread(&h, sizeof(h), 1, f) != 1 || h.magic != STRAT_MAGIC
+                        || h.type != STRAT_DYNAMIC || h.count < 0)
+                return NULL;
+        img = malloc(sizeof(h) + h.count * sizeof(strat_node));
+        *img = h;
+        v = (strat_node*)(img + 1);
+        if(fread(v, sizeof(strat_node), h.count, f) != (size_t)h.count) {
+                free(img);
+                return NULL;
+        }
+        for(j = 0; j < h.count; j++)
+                ns += 2 * v[j].len;
+        img = realloc(img, sizeof(h) + h.count * sizeof(strat_node)
+                        + ns * sizeof(int));
+        v = (strat_node*)(img + 1);
+        if(fread(v + h.count, sizeof(int), ns, f) != (size_t)ns) {
+                free(img);
+                return NULL;
+        }
+        return img;
+}
+
+/* one coordinator thread per connected worker: hand out pending
+ * subtrees until none are left, requeue on a broken connection */
+static void*
+serve_conn(     void *arg       )
+{
+        FILE *f = sock_stream((int)(long)arg);
+        int j;
+
+        for(;;) {
+                pthread_mutex_lock(&dist_mtx);
+                for(j = 0; j < 3 && dsub[j].state != DJ_TODO; j++)
+                        ;
+                if(j < 3)
+                        dsub[j].state = DJ_ACTIVE;
+                pthread_mutex_unlock(&dist_mtx);
+                if(j == 3) {                    // nothing left to hand out
+                        dist_job done = { JOB_MAGIC, dist_nc, variant, -1 };
+                        fwrite(&done, sizeof(done), 1, f);
+                        fflush(f);
+                        break;
+                }
+                if(send_job(f, &dsub[j].c) < 0 ||
+                                (dsub[j].img = recv_image(f)) == NULL) {
+                        pthread_mutex_lock(&dist_mtx);  // requeue the job
+                        dsub[j].state = DJ_TODO;
+                        pthread_mutex_unlock(&dist_mtx);
+                        break;
+                }
+                pthread_mutex_lock(&dist_mtx);
+                dsub[j].state = DJ_DONE;
+                pthread_cond_signal(&dist_cv);
+                pthread_mutex_unlock(&dist_mtx);
+        }
+        fclose(f);
+        return NULL;
+}
+
+static void*
+serve_accept(   void *arg       )
+{
+        int ls = (int)(long)arg, fd;
+        pthread_t th;
+        pthread_attr_t at;
+
+        pthread_attr_init(&at);
+        pthread_attr_setdetachstate(&at, PTHREAD_CREATE_DETACHED);
+        while((fd = accept(ls, NULL, NULL)) >= 0)
+                pthread_create(&th, &at, serve_conn, (void*)(long)fd);
+        return NULL;
+}
+
+static int
+solve_serve(    int port,
+                int n_coins     )
+{
+        struct sockaddr_in sa;
+        pthread_t at;
+        int ls, on = 1, j;
+
+        signal(SIGPIPE, SIG_IGN);
+        logd("Weigh strategy for %d coins (coordinator on port %d):\n\n",
+                n_coins, port);
+
+        /* the first weighing is done locally; its result sets are the
+         * independent subproblems to distribute */
+        coin_set c = new_coins(n_coins);
+        coin_cfg *cfg = get_cfg(c, n_coins);
+        if(num_pos(cfg) <= 1)
+                return 0;
+        int *s1 = NULL, *s2 = NULL;
+        int len = getselection(cfg, &s1, &s2);
+        coin_set cr[3];
+        weigh(c, s1, s2, len, n_coins, cr);
+
+        dist_nc = n_coins;
+        for(j = 0; j < 3; j++) {
+                dsub[j].c = cr[j];
+                dsub[j].img = NULL;
+                dsub[j].state = cr[j].n > 1 ? DJ_TODO : DJ_DONE;
+                if(dsub[j].state == DJ_TODO)
+                        cs_to_runs(&dsub[j].c);
+        }
+
+        ls = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        bzero(&sa, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_ANY);
+        sa.sin_port = htons(port);
+        if(ls < 0 || bind(ls, (struct sockaddr*)&sa, sizeof(sa)) < 0
+                        || listen(ls, 8) < 0) {
+                printf("Cannot listen on port %d.\n", port);
+                exit(1);
+        }
+        pthread_create(&at, NULL, serve_accept, (void*)(long)ls);
+
+        pthread_mutex_lock(&dist_mtx);
+        while(dsub[0].state != DJ_DONE || dsub[1].state != DJ_DONE
+                        || dsub[2].state != DJ_DONE)
+                pthread_cond_wait(&dist_cv, &dist_mtx);
+        pthread_mutex_unlock(&dist_mtx);
+        close(ls);
+
+        /* stitch the worker images under the root weighing */
+        wnode *t = calloc(1, sizeof(wnode));
+        t->s1 = s1;
+        t->s2 = s2;
+        t->len = len;
+        for(j = 0; j < 3; j++) {
+                strat_hdr *h = dsub[j].img;
+                t->size[j] = cr[j].n;
+                t->coin[j] = cr[j].n == 1 ? cr[j].first : 0;
+                t->child[j] = h != NULL && h->count > 0
+                        ? strat_tree((strat_node*)(h + 1),
+                                (int*)((strat_node*)(h + 1) + h->count), 0)
+                        : NULL;
+        }
+        t->depth = 1 + max3(t->child[0] ? t->child[0]->depth : 0,
+                            t->child[1] ? t->child[1]->depth : 0,
+                            t->child[2] ? t->child[2]->depth : 0);
+
+        if(verbose) {
+                if(out_fmt == FMT_JSON)
+                        print_tree_json(t, n_coins);
+                else {
+                        print_tree(t);
+                        out_flush();
+                }
+        }
+        if(verify)
+                verify_tree(t, n_coins);
+        if(out_file)
+                strat_write_dynamic(out_file, t, n_coins);
+        if(cache_dir)
+                cache_store_dynamic(t, n_coins);
+        return t->depth;
+}
+
+/* Serialize a subtree into the file image in memory; the layout is
+ * exactly what strat_write_dynamic() puts on disk.
+ */
+static void
+strat_sides_mem(        wnode *t,
+                        int **sp        )
+{
+        int j;
+        if(t == NULL)
+                return;
+        memcpy(*sp, t->s1, t->len * sizeof(int));
+        *sp += t->len;
+        memcpy(*sp, t->s2, t->len * sizeof(int));
+        *sp += t->len;
+        for(j = 0; j < 3; j++)
+                strat_sides_mem(t->child[j], sp);
+}
+
+static strat_hdr*
+strat_image(    wnode *t,
+                int n_coins,
+                long *size      )
+{
+        int count = strat_count(t), idx = 0;
+        long soff = 0;
+        strat_hdr *img;
+        strat_node *v;
+
+        *size = sizeof(strat_hdr) + count * sizeof(strat_node);
+        img = malloc(*size);
+        strat_hdr h = { STRAT_MAGIC, STRAT_DYNAMIC, n_coins,
+                        t ? t->depth : 0, count };
+        *img = h;
+        v = (strat_node*)(img + 1);
+        strat_fill(t, v, &idx, &soff);
+        *size += soff * sizeof(int);
+        img = realloc(img, *size);
+        int *sp = (int*)((strat_node*)(img + 1) + count);
+        strat_sides_mem(t, &sp);
+        return img;
+}
+
+static void
+worker_loop(    char *spec      )
+{
+        char *colon = strrchr(spec, ':');
+        struct addrinfo hints, *ai;
+        dist_job job;
+
+        if(colon == NULL) {
+                printf("Worker address must be host:port.\n");
+                exit(1);
+        }
+        *colon = 0;
+        bzero(&hints, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if(getaddrinfo(spec, colon + 1, &hints, &ai) != 0) {
+                printf("Cannot resolve %s.\n", spec);
+                exit(1);
+        }
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+                printf("Cannot connect to %s:%s.\n", spec, colon + 1);
+                exit(1);
+        }
+        freeaddrinfo(ai);
+        signal(SIGPIPE, SIG_IGN);
+        FILE *f = sock_stream(fd);
+
+        verbose = 0;            // the solved subtree goes over the wire
+        need_tree = 1;
+        jobs_free = n_jobs - 1;
+        while(fread(&job, sizeof(job), 1, f) == 1
+                        && job.magic == JOB_MAGIC && job.nrun >= 0) {
+                coin_set c;
+                cs_run *runs = arena_alloc(job.nrun * sizeof(cs_run));
+                if(fread(runs, sizeof(cs_run), job.nrun, f)
+                                != (size_t)job.nrun)
+                        break;
+                variant = job.variant;
+                cs_make(&c, runs, job.nrun);
+                wnode *t = build_tree(c, job.n_coins, NULL);
+                long size;
+                strat_hdr *img = strat_image(t, job.n_coins, &size);
+                int ok = fwrite(img, size, 1, f) == 1 && fflush(f) == 0;
+                free(img);
+                free_tree(t);
+                arena_reset();
+                if(!ok)
+                        break;
+        }
+        fclose(f);
+}
+
+
+static void
+usage()
+{
+        fprintf(stderr, "Usage:\n coin [-s (static)] [-n number_of_coins]\
+                [-j number_of_threads] [-M megabytes (memory budget)]\
+                [-q (quiet)] [-d (depth only)] [-V (verify)]\
+                [-t (statistics, needs -DCOIN_STATS)]\
+                [-o strategy_file] [-B n_list_file]\
+                [-C checkpoint_file (static)] [-S cache_dir]\
+                [-v classic|light-only|must-exist]\
+                [-f text|json|csv] [-c none|moves (selection cost model)]\
+                [-P port (serve)] [-W host:port (worker)]\n\
+ coin -L strategy_file -r results (e.g. -r \"+=-0\")\n");
+        exit(0);
+}
+
+/* Depth-only mode (-d): recurse over configuration size tuples alone,
+ * without materializing any possibility set.  The three result tuples
+ * of a weighing are fully determined by the selection arithmetic of
+ * get_sel_A() resp. get_nkl(), so this verifies the selection logic
+ * and reports the required number of weighings in
+ * O(depth * distinct shapes) time and constant memory.  Results are
+ * memoized in the shape cache.
+ */
+static int
+depth_only(     int n_eq,               // coins known to be good
+                int n_more,             // coins possibly too heavy
+                int n_less,             // coins possibly too light
+                int n_dbl,              // coins possibly heavy or light
+                int all_equal   )       // "no false coin" still possible
+{
+        coin_cfg cfg;
+        int d, d0, d1, d2;
+
+        bzero(&cfg, sizeof(cfg));
+        cfg.all_equal = all_equal;
+        cfg.size[C_EQUAL] = n_eq;
+        cfg.size[C_MORE] = n_more;
+        cfg.size[C_LESS] = n_less;
+        cfg.size[C_DOUBLE] = n_dbl;
+
+        if(num_pos(&cfg) <= 1)
+                return 0;
+        if(shape_lookup(&cfg, &d))
+                return d;
+
+        if(n_more == 0 && n_less == 0 && (all_equal || n_dbl > 0)) {    // case A
+                int m = n_dbl, l = 0, n = 0;
+                switch(m % 3){                          // as in get_sel_A
+                case 0:
+                        n = m / 3;
+                        break;
+                case 1:
+                        if(n_eq) {
+                                n = (m + 2) / 3;
+                                l = 1;
+                        } else
+                                n = (m - 1) / 3;
+                        break;
+                case 2:
+                        n = (m + 1) / 3;
+                        break;
+                }
+                /* left arm: n doubles; right arm: n - l doubles, l good */
+                d0 = depth_only(n_eq + m - 2 * n + l, n, n - l, 0, 0);
+                d1 = depth_only(n_eq + 2 * n - l, 0, 0, m - 2 * n + l, all_equal);
+                d2 = depth_only(n_eq + m - 2 * n + l, n - l, n, 0, 0);
+        } else if(n_dbl == 0 && !all_equal) {           // case B
+                int r[4], nc = n_eq + n_more + n_less;
+                get_nkl(&cfg, r);
+                if(r[0] < 0 || r[1] < 0 || r[2] < 0) {  // impossible, try complement
+                        switch_more_less(&cfg);
+                        get_nkl(&cfg, r);
+                        if(r[0] < 0 || r[1] < 0 || r[2] < 0) {
+                                printf("Cannot handle this configuration: \n");
+                                print_cfg(&cfg);
+                                exit(1);
+                        }
+                        n_more = cfg.size[C_MORE];
+                        n_less = cfg.size[C_LESS];
+                }
+                int n1 = r[0], n2 = r[1], k = r[2];
+                /* left arm: n1 from N+, n2 from N-;
+                 * right arm: N+ - n1 from N+, k from N- (plus good coins) */
+                d0 = depth_only(nc - n1 - k, n1, k, 0, 0);
+                d1 = depth_only(nc - (n_less - n2 - k), 0, n_less - n2 - k, 0, 0);
+                d2 = depth_only(nc - (n_more - n1) - n2, n_more - n1, n2, 0, 0);
+        } else if(n_dbl == 0 && all_equal
+                        && (n_more == 0 || n_less == 0)) {      // case L
+                if(n_less == 0) {
+                        n_less = n_more;
+                        n_more = 0;
+                }
+                int np = n_less + 1, n2 = (np + 2) / 3, k, l;
+                k = n_less - n2 < n2 ? n_less - n2 : n2;
+                l = n2 - k;
+                if(l > n_eq) {                  // as in get_sel_L
+                        n2 -= l - n_eq;
+                        k = n_less - n2 < n2 ? n_less - n2 : n2;
+                }
+                /* left arm: n2 from N-; right arm: k from N-, rest good */
+                d0 = depth_only(n_eq + n_less - k, 0, k, 0, 0);
+                d1 = depth_only(n_eq + n2 + k, 0, n_less - n2 - k, 0, 1);
+                d2 = depth_only(n_eq + n_less - n2, 0, n2, 0, 0);
+        } else {
+                printf("Cannot handle this configuration: \n");
+                print_cfg(&cfg);
+                exit(1);
+        }
+        d = 1 + max3(d0, d1, d2);
+        shape_store(&cfg, d);
+        return d;
+}
+
+
+static int depth_mode = 0;              // -d: report the depth only
+
+static int
+solve_one(      int n_coins,
+                int stat        )
+{
+        if(depth_mode)
+                return depth_only(0, 0, variant == VAR_LIGHT ? n_coins : 0,
+                        variant == VAR_LIGHT ? 0 : n_coins,
+                        variant != VAR_EXIST);
+        strat_hdr *h = cache_map(n_coins, stat);
+        if(stat) {
+                if(out_fmt == FMT_TEXT)
+                        logd("Static weigh strategy for %d coins:\n\n", n_coins);
+                return h ? cache_serve(h, 1) : weigh_static(n_coins);
+        }
+        if(out_fmt == FMT_TEXT)
+                logd("Weigh strategy for %d coins:\n\n", n_coins);
+        return h ? cache_serve(h, 0)
+                 : weigh_sequential(new_coins(n_coins), n_coins);
+}
+
+/* Result footer; structured modes keep stdout parseable (CSV stays a
+ * pure table, the record carries what the text footer would say).
+ */
+static void
+print_summary(  int n_steps,
+                int seconds     )
+{
+        switch(out_fmt){
+        case FMT_JSON:
+                printf("{\"type\":\"result\",\"weighings\":%d", n_steps);
+                if(seconds >= 0)
+                        printf(",\"seconds\":%d", seconds);
+                printf("}\n");
+                break;
+        case FMT_CSV:
+                break;
+        default:
+                if(seconds >= 0)
+                        printf("\nRequired %d weighings. Time: %d seconds.\n",
+                                n_steps, seconds);
+                else
+                        printf("\nRequired %d weighings.\n", n_steps);
+                break;
+        }
+}
+
+/* Batch mode (-B file): solve every n listed in the file within one
+ * process.  All jobs share the arena, the shape cache and the static
+ * heavy-code table, so a sweep of n values amortizes the saturated-
+ * base computation instead of paying it per invocation.  Each result
+ * goes to its own file coin-<n>.txt.
+ */
+static void
+solve_batch(    char *file,
+                int stat        )
+{
+        FILE *bf = fopen(file, "r");
+        char fname[32];
+        int n;
+
+        if(bf == NULL) {
+                printf("Cannot read %s.\n", file);
+                exit(1);
+        }
+        while(fscanf(bf, "%d", &n) == 1) {
+                if(n < 3)
+                        continue;
+                snprintf(fname, sizeof(fname), "coin-%d.txt", n);
+                if(freopen(fname, "w", stdout) == NULL) {
+                        fprintf(stderr, "Cannot write %s.\n", fname);
+                        exit(1);
+                }
+                print_summary(solve_one(n, stat), -1);
+                fflush(stdout);
+        }
+        fclose(bf);
+}
+
 
 int
 main(   int argc,
         char **argv     )
 {
-        int k, opt, stat = 0, n_steps;
+        int k, opt, stat = 0, n_steps, serve_port = 0;
         int n_coins = 12;
+        char *lookup_file = NULL, *results = NULL, *batch_file = NULL;
+        char *worker_spec = NULL;
         time_t tc;
-        
-        logd("\n\nCommand line: ");
-        for(k = 0; k < argc; k++)
-                logd(" %s", argv[k]);
-        logd("\n");
-        
-        while ((opt = getopt(argc, argv, "sqn:h?")) != -1) {
+
+        while ((opt = getopt(argc, argv, "sqdVtn:j:M:o:L:r:B:C:S:v:f:c:P:W:h?")) != -1) {
                 switch(opt) {
-                case 'n': 
+                case 'n':
                         n_coins = atoi(optarg);
                         break;
+                case 'j':
+                        n_jobs = atoi(optarg);
+                        if(n_jobs < 1)
+                                n_jobs = 1;
+                        break;
+                case 'M':
+                        mem_budget = (size_t)atol(optarg) << 20;
+                        break;
                 case 'q':
                         verbose = 0;
                         break;
                 case 's':
                         stat = 1;
                         break;
+                case 'd':
+                        depth_mode = 1;
+                        break;
+                case 'V':
+                        verify = 1;
+                        break;
+                case 't':
+#ifdef COIN_STATS
+                        stats_on = 1;
+#else
+                        fprintf(stderr,
+                                "Statistics not compiled in; rebuild with -DCOIN_STATS (make coin-stats).\n");
+#endif
+                        break;
+                case 'o':
+                        out_file = optarg;
+                        break;
+                case 'L':
+                        lookup_file = optarg;
+                        break;
+                case 'r':
+                        results = optarg;
+                        break;
+                case 'B':
+                        batch_file = optarg;
+                        break;
+                case 'C':
+                        ckpt_file = optarg;
+                        break;
+                case 'S':
+                        cache_dir = optarg;
+                        break;
+                case 'P':
+                        serve_port = atoi(optarg);
+                        break;
+                case 'W':
+                        worker_spec = optarg;
+                        break;
+                case 'v':
+                        if(strcmp(optarg, "classic") == 0)
+                                variant = VAR_CLASSIC;
+                        else if(strcmp(optarg, "light-only") == 0)
+                                variant = VAR_LIGHT;
+                        else if(strcmp(optarg, "must-exist") == 0)
+                                variant = VAR_EXIST;
+                        else {
+                                printf("Unknown variant %s.\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'c':
+                        if(strcmp(optarg, "none") == 0)
+                                sel_cost = NULL;
+                        else if(strcmp(optarg, "moves") == 0)
+                                sel_cost = cost_moves;
+                        else {
+                                printf("Unknown cost model %s.\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'f':
+                        if(strcmp(optarg, "text") == 0)
+                                out_fmt = FMT_TEXT;
+                        else if(strcmp(optarg, "json") == 0)
+                                out_fmt = FMT_JSON;
+                        else if(strcmp(optarg, "csv") == 0)
+                                out_fmt = FMT_CSV;
+                        else {
+                                printf("Unknown format %s.\n", optarg);
+                                exit(1);
+                        }
+                        break;
                 case 'h':
                 case '?':
                 default:
@@ -886,24 +3872,179 @@ main(   int argc,
                         break;
                 }
         }
-                        
+
+        if(out_fmt == FMT_TEXT) {
+                logd("\n\nCommand line: ");
+                for(k = 0; k < argc; k++)
+                        logd(" %s", argv[k]);
+                logd("\n");
+        }
+
+        if(lookup_file != NULL) {
+                if(results == NULL)
+                        usage();
+                trit_init();
+                strat_lookup(lookup_file, results);
+                return 0;
+        }
+
+        if(worker_spec != NULL) {
+                trit_init();
+                classify_init();
+                arena_init();
+                worker_loop(worker_spec);
+                arena_reset();
+                arena_free();
+                shape_clear();
+                return 0;
+        }
+        if(serve_port > 0 && (stat || batch_file != NULL)) {
+                printf("The distributed mode builds one dynamic strategy.\n");
+                exit(1);
+        }
+
         if(n_coins < 3) {
                 printf("There must be more than 2 coins.\n");
                 exit(0);
         }
+        if(stat && variant != VAR_CLASSIC) {
+                printf("The static solver supports the classic variant only.\n");
+                exit(1);
+        }
+        if(out_fmt == FMT_CSV && !stat) {
+                printf("-f csv dumps the static code tables; use -s.\n");
+                exit(1);
+        }
+        if(out_fmt == FMT_JSON && stat) {
+                printf("-f json streams the dynamic tree; drop -s or use -f csv.\n");
+                exit(1);
+        }
 
         tc = time(NULL);
+        jobs_free = n_jobs - 1;
+        need_tree = verbose || verify || out_file != NULL
+                        || cache_dir != NULL;
+        trit_init();
+        classify_init();
+        arena_init();
+
+        if(batch_file != NULL)
+                solve_batch(batch_file, stat);
+        else {
+                n_steps = serve_port > 0 ? solve_serve(serve_port, n_coins)
+                                         : solve_one(n_coins, stat);
+                print_summary(n_steps, (int)(time(NULL) - tc));
+        }
+        arena_reset();
+        arena_free();
+        shape_clear();
+        static_clear();
+        STATS_FLUSH();
+        STATS_DUMP();
+}
 
-        if(stat) {
-                logd("Static weigh strategy for %d coins:\n\n", n_coins);  
-                n_steps = weigh_static(n_coins);
-        } else {        
-                logd("Weigh strategy for %d coins:\n\n", n_coins);
-                n_steps = weigh_sequential(new_coins(n_coins), n_coins);
+#else /* COIN_BENCH */
+
+/* Benchmark driver, compiled from this file with -DCOIN_BENCH
+ * (make coin-bench, run via make bench).  Runs both solvers across a
+ * sweep of n, reports nanosecond timings, peak RSS and arena
+ * allocation counts as CSV, and validates the weighing count against
+ * the theoretical optimum ceil(log3(2n + 3)), so a fast-but-wrong
+ * change fails loudly.
+ * Usage: coin-bench [n ...]  (default sweep when no n given)
+ */
+
+static long long
+now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long
+peak_rss_kb()
+{
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_maxrss;
+}
+
+/* Smallest k with (3^k - 1) / 2 - 1 >= n, i.e. ceil(log3(2n + 3))
+ */
+static int
+expected_steps( int n   )
+{
+        int k = 0;
+        long long p = 1;
+        while(p < 2LL * n + 3) {
+                p *= 3;
+                k++;
         }
-        printf("\nRequired %d weighings. Time: %d seconds.\n", n_steps, (int)(time(NULL) - tc));
-        
+        return k;
 }
+
+/* mode: 0 - dynamic, 1 - static, 2 - dynamic with the moves cost
+ * model, which must not change any weighing count */
+static void
+bench_one(      int n,
+                int mode        )
+{
+        static const char *name[] = { "dynamic", "static", "dyn-moves" };
+        arena_nblocks = arena_nbytes = 0;
+        shape_clear();                          // no caching between runs
+        static_clear();
+        arena_init();
+        sel_cost = mode == 2 ? cost_moves : NULL;
+        long long t0 = now_ns();
+        int steps = mode == 1 ? weigh_static(n)
+                              : weigh_sequential(new_coins(n), n);
+        long long dt = now_ns() - t0;
+        arena_reset();
+        arena_free();
+        int want = expected_steps(n);
+        printf("%d,%s,%d,%d,%s,%lld,%ld,%ld,%ld\n",
+                n, name[mode], steps, want,
+                steps == want ? "ok" : "FAIL", dt, peak_rss_kb(),
+                arena_nblocks, arena_nbytes);
+        fflush(stdout);
+        if(steps != want) {
+                fprintf(stderr, "Validation failed for n = %d\n", n);
+                exit(1);
+        }
+}
+
+int
+main(   int argc,
+        char **argv     )
+{
+        int sweep[] = { 12, 120, 1200, 12000, 120000, 1200000 };
+        int n_sweep = sizeof(sweep) / sizeof(int), k;
+
+        verbose = 0;
+        need_tree = 0;
+        trit_init();
+        classify_init();
+        printf("n,mode,weighings,expected,result,ns,peak_rss_kb,arena_blocks,arena_bytes\n");
+        if(argc > 1) {
+                for(k = 1; k < argc; k++) {
+                        bench_one(atoi(argv[k]), 0);
+                        bench_one(atoi(argv[k]), 1);
+                        bench_one(atoi(argv[k]), 2);
+                }
+        } else {
+                for(k = 0; k < n_sweep; k++)
+                        bench_one(sweep[k], 0);
+                for(k = 0; k < n_sweep && sweep[k] <= 1200; k++)
+                        bench_one(sweep[k], 1);         // add() is superlinear, keep the sweep short
+                for(k = 0; k < n_sweep; k++)
+                        bench_one(sweep[k], 2);
+        }
+        return 0;
+}
+
+#endif /* COIN_BENCH */
+
                 
                 
                 